@@ -0,0 +1,258 @@
+/*
+	Streaming overlapping Allan deviation.
+	The stream is fed into an octave-spaced cascade of accumulators, level k covers an averaging time of 2^k samples.
+	Each level keeps the last three block sums of the level below, so memory stays O(log N) for any run length.
+
+	Level k forms the sum Y over 2^k samples at every block boundary of level k-1, i.e. with a stride of tau/2,
+	and accumulates the squared difference of two adjacent, non-overlapping sums D = Y(t + tau) - Y(t).
+	The Allan variance then is sum(D^2) / (2 * n * 4^k) in ADC codes squared.
+	Levels 0 and 1 run on every sample and are vectorized, the remaining levels see half the rate of the level below.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <emmintrin.h>
+#include "ri.h"
+#include "callbacks.h"
+#include "allan.h"
+
+#define ALLAN_LEVELS 48
+#define ALLAN_HISTORY 3
+
+typedef struct allan_level {
+	int64_t z[ALLAN_HISTORY];	// last block sums of the level below, oldest first
+	int n_z;
+	int64_t pair;				// first half of the next block handed to the level above
+	int has_pair;
+} AllanLevel;
+
+typedef struct allan_state {
+	int64_t samples_left;
+	int unlimited;
+	int64_t report_interval;
+	int64_t report_next;
+	int64_t samples_seen;
+
+	// vectorized levels 0 and 1
+	int16_t* scratch;
+	int scratch_size;
+	int16_t tail[ALLAN_HISTORY];
+	int n_tail;
+	int16_t odd_sample;
+	int has_odd_sample;
+	int32_t* pairs;
+
+	AllanLevel levels[ALLAN_LEVELS];
+	double sum_d2[ALLAN_LEVELS];
+	unsigned long long n_d2[ALLAN_LEVELS];
+	unsigned long long dataloss_events;
+} AllanState;
+
+/*
+	Push one block sum of 2^(k-1) samples into level k and carry completed pairs upwards.
+*/
+static void allan_push(AllanState* state, int k, int64_t z) {
+	while (k < ALLAN_LEVELS) {
+		AllanLevel* level = &state->levels[k];
+
+		if (level->n_z == ALLAN_HISTORY) {
+			int64_t d = (level->z[2] + z) - (level->z[0] + level->z[1]);
+			state->sum_d2[k] += (double)d * (double)d;
+			state->n_d2[k]++;
+			level->z[0] = level->z[1];
+			level->z[1] = level->z[2];
+			level->z[2] = z;
+		}
+		else {
+			level->z[level->n_z++] = z;
+		}
+
+		if (!level->has_pair) {
+			level->pair = z;
+			level->has_pair = 1;
+			return;
+		}
+		z += level->pair;
+		level->has_pair = 0;
+		++k;
+	}
+}
+
+static void widen_add(__m128i* acc, __m128i v) {
+	const __m128i zero = _mm_setzero_si128();
+	*acc = _mm_add_epi64(*acc, _mm_unpacklo_epi32(v, zero));
+	*acc = _mm_add_epi64(*acc, _mm_unpackhi_epi32(v, zero));
+}
+
+static unsigned long long hsum64(__m128i v) {
+	unsigned long long lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, v);
+	return lanes[0] + lanes[1];
+}
+
+/*
+	Levels 0 and 1 over every window of four consecutive samples s[j..j+3]:
+	D0 = s3 - s2 and D1 = (s2 + s3) - (s0 + s1). Returns the number of windows.
+*/
+static int allan_fast_levels(AllanState* state, const int16_t* s, int n) {
+	const int windows = n - ALLAN_HISTORY;
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	unsigned long long sum0 = 0, sum1 = 0;
+	int j = 0;
+
+	for (; j + 8 <= windows; j += 8) {
+		__m128i a0 = _mm_loadu_si128((const __m128i*)(s + j));
+		__m128i a1 = _mm_loadu_si128((const __m128i*)(s + j + 1));
+		__m128i a2 = _mm_loadu_si128((const __m128i*)(s + j + 2));
+		__m128i a3 = _mm_loadu_si128((const __m128i*)(s + j + 3));
+		__m128i d0 = _mm_sub_epi16(a3, a2);
+		__m128i d1 = _mm_sub_epi16(_mm_add_epi16(a2, a3), _mm_add_epi16(a0, a1));
+		widen_add(&acc0, _mm_madd_epi16(d0, d0));
+		widen_add(&acc1, _mm_madd_epi16(d1, d1));
+	}
+	for (; j < windows; ++j) {
+		int d0 = s[j + 3] - s[j + 2];
+		int d1 = (s[j + 2] + s[j + 3]) - (s[j] + s[j + 1]);
+		sum0 += (unsigned long long)(d0 * d0);
+		sum1 += (unsigned long long)((int64_t)d1 * d1);
+	}
+
+	if (windows > 0) {
+		state->sum_d2[0] += (double)(hsum64(acc0) + sum0);
+		state->sum_d2[1] += (double)(hsum64(acc1) + sum1);
+		state->n_d2[0] += windows;
+		state->n_d2[1] += windows;
+	}
+	return windows;
+}
+
+/*
+	Sum adjacent samples into blocks of two and feed them into level 2.
+*/
+static void allan_pairs(AllanState* state, const int16_t* x, int n) {
+	const __m128i ones = _mm_set1_epi16(1);
+	int i = 0, m = 0;
+
+	if (n == 0)
+		return;
+	if (state->has_odd_sample) {
+		allan_push(state, 2, state->odd_sample + x[0]);
+		state->has_odd_sample = 0;
+		i = 1;
+	}
+	for (; i + 8 <= n; i += 8, m += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(x + i));
+		_mm_storeu_si128((__m128i*)(state->pairs + m), _mm_madd_epi16(v, ones));
+	}
+	for (; i + 2 <= n; i += 2) {
+		state->pairs[m++] = x[i] + x[i + 1];
+	}
+	if (i < n) {
+		state->odd_sample = x[i];
+		state->has_odd_sample = 1;
+	}
+	for (int k = 0; k < m; ++k) {
+		allan_push(state, 2, state->pairs[k]);
+	}
+}
+
+static void allan_report(const AllanState* state) {
+	for (int k = 0; k < ALLAN_LEVELS && state->n_d2[k] > 0; ++k) {
+		double var = state->sum_d2[k] / (2. * state->n_d2[k] * ldexp(1., 2 * k));
+		printf("DATA: %lld;%g;%g;%llu\n", state->samples_seen, ldexp(1. / SAMPLE_RATE, k), sqrt(var), state->n_d2[k]);
+	}
+}
+
+/*
+	Feed the chunk through the accumulator cascade.
+	Prints samples;tau;adev;n for every populated level each report interval.
+*/
+int callback_allan(uint16_t* data, int ndata, int dataloss, void* userdata)
+{
+	AllanState* state = (AllanState*)userdata;
+
+	if (dataloss) {
+		printf("ERR!: DATA LOSS DETECTED\n");
+		state->dataloss_events++;
+	}
+
+	if (state->n_tail + ndata > state->scratch_size) {
+		free(state->scratch);
+		free(state->pairs);
+		state->scratch_size = 2 * (state->n_tail + ndata);
+		state->scratch = malloc(state->scratch_size * sizeof(int16_t));
+		state->pairs = malloc(state->scratch_size / 2 * sizeof(int32_t));
+		if (state->scratch == NULL || state->pairs == NULL) {
+			printf("ERR!: OUT OF MEMORY\n");
+			return 0;
+		}
+	}
+
+	// masked samples, prefixed with the last samples of the previous chunk
+	int16_t* s = state->scratch;
+	int16_t* x = s + state->n_tail;
+	const __m128i mask = _mm_set1_epi16(SAMPLE_DATA_MASK);
+	int i = 0;
+	memcpy(s, state->tail, state->n_tail * sizeof(int16_t));
+	for (; i + 8 <= ndata; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+		_mm_storeu_si128((__m128i*)(x + i), _mm_and_si128(v, mask));
+	}
+	for (; i < ndata; ++i) {
+		x[i] = data[i] & SAMPLE_DATA_MASK;
+	}
+
+	const int n = state->n_tail + ndata;
+	allan_fast_levels(state, s, n);
+	allan_pairs(state, x, ndata);
+
+	state->n_tail = n < ALLAN_HISTORY ? n : ALLAN_HISTORY;
+	memcpy(state->tail, s + n - state->n_tail, state->n_tail * sizeof(int16_t));
+
+	state->samples_seen += ndata;
+	if (state->samples_seen >= state->report_next) {
+		allan_report(state);
+		state->report_next += state->report_interval;
+	}
+
+	return samples_remaining(&state->samples_left, ndata, state->unlimited);
+}
+
+/*
+	Run the Allan deviation measurement until n_samples are processed, or until Ctrl+C if n_samples is 0.
+*/
+ERROR_STATUS run_allan(ri_device* device, const Config* config) {
+	AllanState* state = calloc(1, sizeof(AllanState));
+	if (state == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		return STATUS_FAILURE;
+	}
+	state->samples_left = config->n_samples;
+	state->unlimited = config->n_samples == 0;
+	state->report_interval = config->report_interval;
+	state->report_next = config->report_interval;
+
+	install_stop_handler();
+
+	printf("META: REQUEST ALLAN SAMPLES %llu\n", config->n_samples);
+	printf("META: START_OF_STREAM\n");
+	double initial_time = (double)clock() / CLOCKS_PER_SEC;
+	int err = ri_start_continuous_transfer(device, callback_allan, state);
+	double final_time = (double)clock() / CLOCKS_PER_SEC;
+	allan_report(state);
+	printf("META: END_OF_STREAM\n");
+
+	remove_stop_handler();
+
+	print_transfer_summary(state->samples_seen, final_time - initial_time);
+	printf("META: DATA LOSS EVENTS %llu\n", state->dataloss_events);
+
+	free(state->scratch);
+	free(state->pairs);
+	free(state);
+	return err == 0 ? STATUS_SUCCESS : STATUS_FAILURE;
+}
@@ -0,0 +1,11 @@
+#ifndef ALLAN_H
+#define ALLAN_H
+
+#include "ri.h"
+#include "config.h"
+#include "libdpd80.h"
+
+ERROR_STATUS run_allan(ri_device* device, const Config* config);
+int callback_allan(uint16_t* data, int ndata, int dataloss, void* userdata);
+
+#endif
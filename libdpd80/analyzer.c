@@ -0,0 +1,372 @@
+/*
+	Offline analysis of raw recordings (little endian uint16_t samples as streamed by the device).
+	The recording is memory mapped and split into a fixed number of slices that worker threads pick up one by one.
+	A segmented recording of the record mode (<path>.idx next to <path>.NNNNNN.raw) is analyzed as one stream: every
+	segment is mapped on its own and slices are also cut at segment boundaries, so no slice spans two mappings.
+	Each slice produces a partial result with the same kernels as the live measurements. Partial results are merged
+	in slice order after all threads finished, so the output does not depend on the number of threads.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <windows.h>
+#include "kernels.h"
+#include "callbacks.h"
+#include "recorder.h"
+#include "analyzer.h"
+
+#define ANALYZER_SLICES 256
+#define ANALYZER_ALIGN (1 << 20)	// slice boundaries are multiples of this many samples
+#define ANALYZER_MAX_THREADS 64
+#define COUNTER_CHUNK 10240			// samples per DATA line, as delivered by the device
+
+typedef struct analyzer_segment {
+	HANDLE file;
+	HANDLE mapping;
+	const uint16_t* data;
+	int64_t begin;					// first sample of the segment in the recording
+	int64_t n_samples;
+} AnalyzerSegment;
+
+typedef struct analyzer_slice {
+	int64_t begin;
+	int64_t end;
+	const uint16_t* data;			// sample begin in its segment mapping
+
+	// counter sums of the chunks cut by the slice boundaries
+	int64_t head_chunk;
+	unsigned long long head_sum;
+	int64_t tail_chunk;
+	unsigned long long tail_sum;
+
+	SampleStats stats;
+	double* power;
+	unsigned long long n_segments;
+} AnalyzerSlice;
+
+typedef struct analyzer_job {
+	AnalyzerSegment* segments;
+	int n_segments;
+	int64_t n_samples;
+	const Config* config;
+
+	AnalyzerSlice* slices;
+	int n_slices;
+	volatile LONG next_slice;
+
+	unsigned long long* counter_sums;
+	Histogram* histograms[ANALYZER_MAX_THREADS];
+	volatile LONG failed;
+} AnalyzerJob;
+
+typedef struct analyzer_worker {
+	AnalyzerJob* job;
+	int index;
+} AnalyzerWorker;
+
+static void analyze_counter(AnalyzerJob* job, AnalyzerSlice* slice) {
+	const int64_t c0 = slice->begin / COUNTER_CHUNK;
+	const int64_t c1 = (slice->end - 1) / COUNTER_CHUNK;
+	slice->head_chunk = -1;
+	slice->tail_chunk = -1;
+
+	for (int64_t c = c0; c <= c1; ++c) {
+		const int64_t chunk_begin = c * COUNTER_CHUNK;
+		const int64_t chunk_end = chunk_begin + COUNTER_CHUNK < job->n_samples ? chunk_begin + COUNTER_CHUNK : job->n_samples;
+		const int64_t lo = chunk_begin > slice->begin ? chunk_begin : slice->begin;
+		const int64_t hi = chunk_end < slice->end ? chunk_end : slice->end;
+		const unsigned long long sum = kernel_counter_sum(slice->data + (lo - slice->begin), hi - lo);
+
+		if (lo == chunk_begin && hi == chunk_end) {
+			job->counter_sums[c] = sum;
+		}
+		else if (c == c0) {
+			slice->head_chunk = c;
+			slice->head_sum = sum;
+		}
+		else {
+			slice->tail_chunk = c;
+			slice->tail_sum = sum;
+		}
+	}
+}
+
+static DWORD WINAPI analyzer_thread(LPVOID param) {
+	AnalyzerWorker* worker = (AnalyzerWorker*)param;
+	AnalyzerJob* job = worker->job;
+	const AnalysisKernel kernel = job->config->analysis_kernel;
+	Psd* psd = NULL;
+
+	if (kernel == ANALYSIS_HISTOGRAM) {
+		job->histograms[worker->index] = calloc(1, sizeof(Histogram));
+		if (job->histograms[worker->index] == NULL) {
+			InterlockedExchange(&job->failed, 1);
+			return 1;
+		}
+	}
+	if (kernel == ANALYSIS_PSD) {
+		psd = psd_create((int)job->config->nfft);
+		if (psd == NULL) {
+			InterlockedExchange(&job->failed, 1);
+			return 1;
+		}
+	}
+
+	for (LONG s = InterlockedIncrement(&job->next_slice) - 1; s < job->n_slices && !job->failed;
+		s = InterlockedIncrement(&job->next_slice) - 1) {
+		AnalyzerSlice* slice = &job->slices[s];
+		const uint16_t* data = slice->data;
+		const int64_t n = slice->end - slice->begin;
+
+		switch (kernel) {
+		case ANALYSIS_COUNTER:
+			analyze_counter(job, slice);
+			break;
+		case ANALYSIS_HISTOGRAM:
+			kernel_histogram(data, n, job->histograms[worker->index]);
+			break;
+		case ANALYSIS_STATS:
+			stats_init(&slice->stats);
+			kernel_stats(data, n, &slice->stats);
+			break;
+		case ANALYSIS_PSD:
+			slice->power = malloc((psd->nfft / 2 + 1) * sizeof(double));
+			if (slice->power == NULL) {
+				InterlockedExchange(&job->failed, 1);
+				break;
+			}
+			memset(psd->power, 0, (psd->nfft / 2 + 1) * sizeof(double));
+			psd->n_segments = 0;
+			kernel_psd(data, n, psd);
+			memcpy(slice->power, psd->power, (psd->nfft / 2 + 1) * sizeof(double));
+			slice->n_segments = psd->n_segments;
+			break;
+		}
+	}
+
+	psd_destroy(psd);
+	return 0;
+}
+
+static void print_results(AnalyzerJob* job, int n_threads) {
+	const Config* config = job->config;
+
+	if (config->analysis_kernel == ANALYSIS_COUNTER) {
+		for (int s = 0; s < job->n_slices; ++s) {
+			if (job->slices[s].head_chunk >= 0)
+				job->counter_sums[job->slices[s].head_chunk] += job->slices[s].head_sum;
+			if (job->slices[s].tail_chunk >= 0)
+				job->counter_sums[job->slices[s].tail_chunk] += job->slices[s].tail_sum;
+		}
+		for (int64_t c = 0; c * COUNTER_CHUNK < job->n_samples; ++c) {
+			const int64_t left = job->n_samples - c * COUNTER_CHUNK;
+			printf("DATA: %d;%llu\n", left < COUNTER_CHUNK ? (int)left : COUNTER_CHUNK, job->counter_sums[c]);
+		}
+	}
+	else if (config->analysis_kernel == ANALYSIS_HISTOGRAM) {
+		for (int t = 1; t < n_threads; ++t) {
+			histogram_merge(job->histograms[0], job->histograms[t]);
+		}
+		for (int code = 0; code < HISTOGRAM_BINS; ++code) {
+			const unsigned long long count = histogram_bin(job->histograms[0], code);
+			if (count > 0)
+				printf("DATA: %d;%llu\n", code, count);
+		}
+	}
+	else if (config->analysis_kernel == ANALYSIS_STATS) {
+		SampleStats stats;
+		stats_init(&stats);
+		for (int s = 0; s < job->n_slices; ++s) {
+			stats_merge(&stats, &job->slices[s].stats);
+		}
+		printf("DATA: %llu;%.6f;%.6f;%d;%d\n", stats.n, stats.mean,
+			stats.n > 1 ? sqrt(stats.m2 / (stats.n - 1)) : 0., stats.min, stats.max);
+	}
+	else {
+		Psd* psd = psd_create((int)config->nfft);
+		if (psd == NULL) {
+			printf("ERR!: OUT OF MEMORY\n");
+			return;
+		}
+		for (int s = 0; s < job->n_slices; ++s) {
+			for (int k = 0; k <= psd->nfft / 2; ++k) {
+				psd->power[k] += job->slices[s].power[k];
+			}
+			psd->n_segments += job->slices[s].n_segments;
+		}
+		for (int k = 0; k <= psd->nfft / 2; ++k) {
+			printf("DATA: %g;%g\n", (double)k * SAMPLE_RATE / psd->nfft, psd_density(psd, k, SAMPLE_RATE));
+		}
+		psd_destroy(psd);
+	}
+}
+
+/*
+	Map the whole file path as the segment starting at sample begin. Prints nothing, the caller reports failures.
+*/
+static int map_segment(const char* path, int64_t begin, AnalyzerSegment* segment) {
+	segment->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (segment->file == INVALID_HANDLE_VALUE)
+		return 0;
+	LARGE_INTEGER size;
+	segment->mapping = NULL;
+	segment->data = NULL;
+	if (GetFileSizeEx(segment->file, &size) && size.QuadPart >= (LONGLONG)sizeof(uint16_t)) {
+		segment->mapping = CreateFileMappingA(segment->file, NULL, PAGE_READONLY, 0, 0, NULL);
+		segment->data = segment->mapping ? MapViewOfFile(segment->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	}
+	if (segment->data == NULL) {
+		if (segment->mapping)
+			CloseHandle(segment->mapping);
+		CloseHandle(segment->file);
+		return 0;
+	}
+	segment->begin = begin;
+	segment->n_samples = size.QuadPart / sizeof(uint16_t);
+	return 1;
+}
+
+static void unmap_segment(AnalyzerSegment* segment) {
+	UnmapViewOfFile(segment->data);
+	CloseHandle(segment->mapping);
+	CloseHandle(segment->file);
+}
+
+/*
+	Map config->input_path, or all segments written so far if it names a segmented recording.
+*/
+static int map_recording(AnalyzerJob* job, const char* path) {
+	Recording* recording = recording_open(path);
+	if (recording == NULL) {
+		job->segments = calloc(1, sizeof(AnalyzerSegment));
+		if (job->segments == NULL || !map_segment(path, 0, &job->segments[0]))
+			return 0;
+		job->n_segments = 1;
+		job->n_samples = job->segments[0].n_samples;
+		return 1;
+	}
+
+	const int64_t segment_samples = (int64_t)recording->header.segment_samples;
+	recording_close(recording);
+	char segment_path[1024];
+	for (;;) {
+		recording_segment_path(path, job->n_segments, segment_path, sizeof(segment_path));
+		AnalyzerSegment* segments = realloc(job->segments, (job->n_segments + 1) * sizeof(AnalyzerSegment));
+		if (segments == NULL)
+			return 0;
+		job->segments = segments;
+		if (!map_segment(segment_path, job->n_samples, &job->segments[job->n_segments]))
+			break;
+		job->n_samples += job->segments[job->n_segments].n_samples;
+		// only the last segment may be short, it is still being written
+		if (job->segments[job->n_segments++].n_samples < segment_samples)
+			break;
+	}
+	return job->n_segments > 0;
+}
+
+/*
+	Analyze the recording config->input_path with all available cores.
+*/
+ERROR_STATUS run_analyzer(const Config* config) {
+	AnalyzerJob* job = calloc(1, sizeof(AnalyzerJob));
+	ERROR_STATUS status = STATUS_FAILURE;
+	if (job == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		return STATUS_FAILURE;
+	}
+	job->config = config;
+	if (!map_recording(job, config->input_path)) {
+		printf("ERR!: CANNOT MAP %s\n", config->input_path);
+		goto cleanup;
+	}
+
+	// fixed slicing, independent of the number of cores, also cut at segment boundaries
+	const int64_t blocks = (job->n_samples + ANALYZER_ALIGN - 1) / ANALYZER_ALIGN;
+	const int64_t slice_samples = (blocks + ANALYZER_SLICES - 1) / ANALYZER_SLICES * ANALYZER_ALIGN;
+	job->slices = calloc(ANALYZER_SLICES + job->n_segments, sizeof(AnalyzerSlice));
+	if (job->slices == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		goto cleanup;
+	}
+	for (int g = 0; g < job->n_segments; ++g) {
+		const AnalyzerSegment* segment = &job->segments[g];
+		const int64_t segment_end = segment->begin + segment->n_samples;
+		for (int64_t begin = segment->begin; begin < segment_end; ) {
+			const int64_t next = (begin / slice_samples + 1) * slice_samples;
+			AnalyzerSlice* slice = &job->slices[job->n_slices++];
+			slice->begin = begin;
+			slice->end = next < segment_end ? next : segment_end;
+			slice->data = segment->data + (begin - segment->begin);
+			begin = slice->end;
+		}
+	}
+	if (config->analysis_kernel == ANALYSIS_COUNTER) {
+		job->counter_sums = calloc((size_t)((job->n_samples + COUNTER_CHUNK - 1) / COUNTER_CHUNK), sizeof(unsigned long long));
+		if (job->counter_sums == NULL) {
+			printf("ERR!: OUT OF MEMORY\n");
+			goto cleanup;
+		}
+	}
+
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int n_threads = (int)info.dwNumberOfProcessors;
+	if (n_threads > ANALYZER_MAX_THREADS)
+		n_threads = ANALYZER_MAX_THREADS;
+	if (n_threads > job->n_slices)
+		n_threads = job->n_slices;
+
+	printf("META: ANALYZE %s\n", config->input_path);
+	printf("META: SEGMENTS %d\n", job->n_segments);
+	printf("META: SAMPLES %lld\n", job->n_samples);
+	printf("META: THREADS %d\n", n_threads);
+	printf("META: START_OF_STREAM\n");
+	double initial_time = (double)clock() / CLOCKS_PER_SEC;
+
+	AnalyzerWorker workers[ANALYZER_MAX_THREADS];
+	HANDLE threads[ANALYZER_MAX_THREADS];
+	int started = 0;
+	for (; started < n_threads; ++started) {
+		workers[started].job = job;
+		workers[started].index = started;
+		threads[started] = CreateThread(NULL, 0, analyzer_thread, &workers[started], 0, NULL);
+		if (threads[started] == NULL)
+			break;
+	}
+	for (int t = 0; t < started; ++t) {
+		WaitForSingleObject(threads[t], INFINITE);
+		CloseHandle(threads[t]);
+	}
+	double final_time = (double)clock() / CLOCKS_PER_SEC;
+
+	if (started == 0 || job->failed) {
+		printf("ERR!: ANALYSIS FAILED\n");
+	}
+	else {
+		print_results(job, started);
+		status = STATUS_SUCCESS;
+	}
+	printf("META: END_OF_STREAM\n");
+	print_transfer_summary(job->n_samples, final_time - initial_time);
+
+cleanup:
+	for (int s = 0; s < job->n_slices; ++s) {
+		free(job->slices[s].power);
+	}
+	for (int t = 0; t < ANALYZER_MAX_THREADS; ++t) {
+		free(job->histograms[t]);
+	}
+	for (int g = 0; g < job->n_segments; ++g) {
+		unmap_segment(&job->segments[g]);
+	}
+	free(job->segments);
+	free(job->slices);
+	free(job->counter_sums);
+	free(job);
+	return status;
+}
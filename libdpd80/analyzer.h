@@ -0,0 +1,9 @@
+#ifndef ANALYZER_H
+#define ANALYZER_H
+
+#include "config.h"
+#include "libdpd80.h"
+
+ERROR_STATUS run_analyzer(const Config* config);
+
+#endif
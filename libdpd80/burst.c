@@ -0,0 +1,218 @@
+/*
+	Burst capture with ri_get_raw_data / ri_get_raw_data_triggered without one buffer for the whole burst.
+	The burst is taken as back-to-back sub-captures of config->burst_chunk samples into two pooled buffers: while the
+	device fills one buffer, a consumer thread hands the other one to the recorder and computes its statistics.
+	The device is idle between sub-captures, so the gap of every sub-capture is measured as the wall time between the
+	last samples of consecutive sub-captures minus the sampled time; the duty cycle is sampled time over elapsed time.
+	A trigger only arms the first sub-capture, so the wait for it is not part of any gap.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "ri.h"
+#include "callbacks.h"
+#include "kernels.h"
+#include "recorder.h"
+#include "burst.h"
+
+#define BURST_BUFFERS 2
+
+typedef struct burst_buffer {
+	uint16_t* data;
+	int full;
+	int64_t sequence;
+	int64_t n;
+	double start;				// s since the first sub-capture was requested
+	double gap;					// s, negative for the first sub-capture
+	int64_t time_ns;			// wall clock at the end of the sub-capture
+} BurstBuffer;
+
+typedef struct burst_state {
+	BurstBuffer buffers[BURST_BUFFERS];
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE changed;
+	int done;
+	Recorder* recorder;
+	int recorder_failed;
+	double stall;				// s the capture waited for the consumer
+} BurstState;
+
+/*
+	Record and summarize the filled buffers in capture order.
+*/
+static DWORD WINAPI burst_consumer(LPVOID param) {
+	BurstState* state = (BurstState*)param;
+	EnterCriticalSection(&state->lock);
+	for (int64_t k = 0;; ++k) {
+		BurstBuffer* buffer = &state->buffers[k % BURST_BUFFERS];
+		while (!buffer->full && !state->done)
+			SleepConditionVariableCS(&state->changed, &state->lock, INFINITE);
+		if (!buffer->full)
+			break;
+		LeaveCriticalSection(&state->lock);
+
+		if (state->recorder != NULL && !state->recorder_failed) {
+			// the device does not sample between sub-captures, so every later one starts with a discontinuity
+			int64_t i = 0;
+			while (i < buffer->n && !state->recorder_failed) {
+				const int n = buffer->n - i < (1 << 30) ? (int)(buffer->n - i) : (1 << 30);
+				const int64_t time_ns = buffer->time_ns - (int64_t)((double)(buffer->n - i - n) * 1e9 / SAMPLE_RATE);
+				if (!recorder_write(state->recorder, buffer->data + i, n, i == 0 && buffer->sequence > 0, time_ns)) {
+					printf("ERR!: WRITE FAILED\n");
+					state->recorder_failed = 1;
+				}
+				i += n;
+			}
+		}
+		SampleStats stats;
+		stats_init(&stats);
+		kernel_stats(buffer->data, buffer->n, &stats);
+		printf("DATA: %lld;%.6f;%lld;%.9f;%.4f;%.4f\n", buffer->sequence, buffer->start, buffer->n, buffer->gap,
+			stats.mean, stats.n > 1 ? sqrt(stats.m2 / (stats.n - 1)) : 0.);
+
+		EnterCriticalSection(&state->lock);
+		buffer->full = 0;
+		WakeAllConditionVariable(&state->changed);
+	}
+	LeaveCriticalSection(&state->lock);
+	return 0;
+}
+
+/*
+	Capture config->n_samples in sub-captures, or until Ctrl+C if n_samples is 0.
+*/
+ERROR_STATUS run_burst(ri_device* device, const Config* config) {
+	BurstState* state = calloc(1, sizeof(BurstState));
+	if (state == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		return STATUS_FAILURE;
+	}
+	InitializeCriticalSection(&state->lock);
+	InitializeConditionVariable(&state->changed);
+
+	int allocated = 1;
+	for (int b = 0; b < BURST_BUFFERS; ++b) {
+		state->buffers[b].data = malloc((size_t)config->burst_chunk * sizeof(uint16_t));
+		allocated = allocated && state->buffers[b].data != NULL;
+	}
+	if (config->output_path != NULL) {
+		state->recorder = recorder_create(config->output_path, config->segment_samples);
+		if (state->recorder == NULL) {
+			printf("ERR!: CANNOT CREATE RECORDING %s\n", config->output_path);
+			allocated = 0;
+		}
+	}
+	HANDLE consumer = allocated ? CreateThread(NULL, 0, burst_consumer, state, 0, NULL) : NULL;
+	if (consumer == NULL) {
+		if (allocated)
+			printf("ERR!: CANNOT START CONSUMER\n");
+		else
+			printf("ERR!: OUT OF MEMORY\n");
+		recorder_destroy(state->recorder);
+		for (int b = 0; b < BURST_BUFFERS; ++b)
+			free(state->buffers[b].data);
+		DeleteCriticalSection(&state->lock);
+		free(state);
+		return STATUS_FAILURE;
+	}
+
+	install_stop_handler();
+
+	printf("META: REQUEST BURST SAMPLES %llu\n", config->n_samples);
+	printf("META: SUB-CAPTURE SAMPLES %llu\n", config->burst_chunk);
+	printf("META: TRIGGER MODE %d\n", config->trigger_mode);
+	printf("META: START_OF_STREAM\n");
+
+	LARGE_INTEGER frequency, origin, now;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&origin);
+	double previous_end = 0.;
+	double gap_sum = 0., gap_min = 0., gap_max = 0.;
+	int64_t samples = 0;
+	int64_t k = 0;
+	int err = 0;
+	while (!stop_requested && (config->n_samples == 0 || (uint64_t)samples < config->n_samples)) {
+		BurstBuffer* buffer = &state->buffers[k % BURST_BUFFERS];
+		uint64_t n = config->burst_chunk;
+		if (config->n_samples != 0 && config->n_samples - samples < n)
+			n = config->n_samples - samples;
+
+		// wait until the consumer released this buffer
+		QueryPerformanceCounter(&now);
+		const double wait_start = (double)(now.QuadPart - origin.QuadPart) / frequency.QuadPart;
+		EnterCriticalSection(&state->lock);
+		while (buffer->full)
+			SleepConditionVariableCS(&state->changed, &state->lock, INFINITE);
+		LeaveCriticalSection(&state->lock);
+		QueryPerformanceCounter(&now);
+		const double start = (double)(now.QuadPart - origin.QuadPart) / frequency.QuadPart;
+		state->stall += start - wait_start;
+
+		// only the first sub-capture waits for the trigger, the rest of the burst follows it back to back
+		if (config->trigger_mode == RI_TRIG_AUTO || k > 0)
+			err = ri_get_raw_data(device, n, buffer->data);
+		else
+			err = ri_get_raw_data_triggered(device, n, buffer->data, config->trigger_mode);
+		QueryPerformanceCounter(&now);
+		const double end = (double)(now.QuadPart - origin.QuadPart) / frequency.QuadPart;
+		if (err != 0) {
+			printf("ERR!: SUB-CAPTURE %lld FAILED\n", k);
+			break;
+		}
+
+		// the first sub-capture only gives the end of its samples, later ones the time not covered by samples
+		const double gap = k > 0 ? end - previous_end - (double)n / SAMPLE_RATE : -1.;
+		if (k > 0) {
+			gap_sum += gap;
+			gap_min = k == 1 || gap < gap_min ? gap : gap_min;
+			gap_max = k == 1 || gap > gap_max ? gap : gap_max;
+		}
+		previous_end = end;
+
+		EnterCriticalSection(&state->lock);
+		buffer->sequence = k;
+		buffer->n = (int64_t)n;
+		buffer->start = start;
+		buffer->gap = gap;
+		buffer->time_ns = wall_clock_ns();
+		buffer->full = 1;
+		WakeAllConditionVariable(&state->changed);
+		LeaveCriticalSection(&state->lock);
+
+		samples += n;
+		++k;
+	}
+
+	EnterCriticalSection(&state->lock);
+	state->done = 1;
+	WakeAllConditionVariable(&state->changed);
+	LeaveCriticalSection(&state->lock);
+	WaitForSingleObject(consumer, INFINITE);
+	CloseHandle(consumer);
+	printf("META: END_OF_STREAM\n");
+
+	remove_stop_handler();
+
+	// sampled time plus the gaps spans the first to the last sample
+	const double sampled = (double)samples / SAMPLE_RATE;
+	const double span = sampled + gap_sum;
+	printf("META: SUB-CAPTURES %lld\n", k);
+	print_transfer_summary(samples, previous_end);
+	if (k > 1) {
+		printf("META: GAP MEAN / s %.9f\n", gap_sum / (k - 1));
+		printf("META: GAP MIN / s %.9f\n", gap_min);
+		printf("META: GAP MAX / s %.9f\n", gap_max);
+	}
+	printf("META: DUTY CYCLE %.6f\n", span > 0. ? sampled / span : 0.);
+	printf("META: CONSUMER STALL / s %g\n", state->stall);
+
+	const int failed = state->recorder_failed;
+	recorder_destroy(state->recorder);
+	for (int b = 0; b < BURST_BUFFERS; ++b)
+		free(state->buffers[b].data);
+	DeleteCriticalSection(&state->lock);
+	free(state);
+	return err == 0 && !failed ? STATUS_SUCCESS : STATUS_FAILURE;
+}
@@ -0,0 +1,10 @@
+#ifndef BURST_H
+#define BURST_H
+
+#include "ri.h"
+#include "config.h"
+#include "libdpd80.h"
+
+ERROR_STATUS run_burst(ri_device* device, const Config* config);
+
+#endif
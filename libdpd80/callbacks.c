@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include "ri.h"
 #include "callbacks.h"
+#include "kernels.h"
 
 int transfer_callback(uint16_t* data, int ndata, int dataloss, void* userdata)
 {
@@ -25,19 +26,71 @@ int transfer_callback(uint16_t* data, int ndata, int dataloss, void* userdata)
 */
 int callback_counter(uint16_t* data, int ndata, int dataloss, void* userdata)
 {
-	unsigned long long sum = 0;
-	int64_t* samples_left = (int64_t*)userdata;
+	CounterUserdata* state = (CounterUserdata*)userdata;
 
 	if (dataloss)
 		printf("ERR!: DATA LOSS DETECTED\n");
 
-	for (int i = 0; i < ndata; ++i)
-	{
-		sum += data[i] & 0x03ff;	// apply data bit mask
-	}
+	unsigned long long sum = kernel_counter_sum(data, ndata);	// applies data bit mask
 	printf("DATA: %d;%llu\n", ndata, sum);
 
+	return samples_remaining(&state->samples_left, ndata, state->unlimited);
+}
+
+/*
+	Accumulate the histogram of the ADC codes, printed by main once the transfer ends.
+*/
+int callback_histogram(uint16_t* data, int ndata, int dataloss, void* userdata)
+{
+	HistogramUserdata* state = (HistogramUserdata*)userdata;
+
+	if (dataloss)
+		printf("ERR!: DATA LOSS DETECTED\n");
+
+	kernel_histogram(data, ndata, state->histogram);
+
+	return samples_remaining(&state->samples_left, ndata, state->unlimited);
+}
+
+/*
+	Ctrl+C ends a running transfer cleanly, so every measurement can restore the device
+	and print its summary.
+*/
+volatile sig_atomic_t stop_requested = 0;
+
+static void on_sigint(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
+}
+
+void install_stop_handler(void)
+{
+	stop_requested = 0;
+	signal(SIGINT, on_sigint);
+}
+
+void remove_stop_handler(void)
+{
+	signal(SIGINT, SIG_DFL);
+}
+
+/*
+	Count down samples_left and return whether the transfer should continue.
+	Unlimited transfers only stop on Ctrl+C.
+*/
+int samples_remaining(int64_t* samples_left, int ndata, int unlimited)
+{
 	*samples_left -= ndata;
+	if (stop_requested)
+		return 0;
+	return unlimited || *samples_left > 0;
+}
 
-	return *samples_left > 0;
+void print_transfer_summary(int64_t samples_transferred, double elapsed_time)
+{
+	double MBs_transferred = samples_transferred * 2. / 1000000.;
+	printf("META: TRANSFERED / MB %.1f\n", MBs_transferred);
+	printf("META: ELAPSED TIME / s %g\n", elapsed_time);
+	printf("META: SPEED / MBPS %.2f\n", MBs_transferred / elapsed_time);
 }
@@ -1,7 +1,31 @@
 #ifndef CALLBACKS_H
 #define CALLBACKS_H
 
+#include <signal.h>
+#include <stdint.h>
+
+struct histogram;
+
+typedef struct counter_userdata {
+	int64_t samples_left;
+	int unlimited;
+} CounterUserdata;
+
+typedef struct histogram_userdata {
+	int64_t samples_left;
+	int unlimited;
+	struct histogram* histogram;
+} HistogramUserdata;
+
+extern volatile sig_atomic_t stop_requested;
+
 int transfer_callback(uint16_t* data, int ndata, int dataloss, void* userdata);
 int callback_counter(uint16_t* data, int ndata, int dataloss, void* userdata);
+int callback_histogram(uint16_t* data, int ndata, int dataloss, void* userdata);
+
+void install_stop_handler(void);
+void remove_stop_handler(void);
+int samples_remaining(int64_t* samples_left, int ndata, int unlimited);
+void print_transfer_summary(int64_t samples_transferred, double elapsed_time);
 
 #endif
@@ -1,21 +1,500 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "config.h"
 #include "libdpd80.h"
 
-ERROR_STATUS parse_config(int argc, char* argv[], Config* config) {
-	// default settings if no args are given
-	if (argc == 1) {
-		config->measurement_type = COUNTER;
-		config->n_samples = 80 * 1000 * 1000;	// 1s of measurement time
+static ERROR_STATUS parse_samples_or_duration(const char* arg, unsigned long long* samples) {
+	// <n_samples> as an integer or a duration <n>s, <n>m, <n>h or <n>d, converted at the nominal sample rate
+	char* end;
+	if (arg[0] == '-') {
+		return STATUS_FAILURE;
+	}
+	const unsigned long long n_samples = strtoull(arg, &end, 0);
+	if (end != arg && *end == '\0') {
+		*samples = n_samples;
+		return STATUS_SUCCESS;
+	}
+
+	const double value = strtod(arg, &end);
+	double seconds = 0.;
+	if (end == arg || value < 0.) {
+		return STATUS_FAILURE;
+	}
+	if (strcmp(end, "s") == 0) {
+		seconds = value;
+	}
+	else if (strcmp(end, "m") == 0) {
+		seconds = value * 60.;
+	}
+	else if (strcmp(end, "h") == 0) {
+		seconds = value * 3600.;
 	}
-	else if (argc == 2) {
-		if (strcmp(argv[1], "histogram") == 0) {
-			config->measurement_type = HISTOGRAM;
+	else if (strcmp(end, "d") == 0) {
+		seconds = value * 86400.;
+	}
+	else {
+		return STATUS_FAILURE;
+	}
+	*samples = (unsigned long long)(seconds * SAMPLE_RATE + 0.5);
+	return STATUS_SUCCESS;
+}
+
+static ERROR_STATUS parse_length(const char* arg, Config* config) {
+	return parse_samples_or_duration(arg, &config->n_samples);
+}
+
+static ERROR_STATUS parse_selftest(int argc, char* argv[], Config* config) {
+	// selftest [pn9|checkerboard|user <value>] [n_samples]
+	int i = 2;
+	if (i < argc) {
+		if (strcmp(argv[i], "pn9") == 0) {
+			config->test_pattern = TEST_PN9;
+			++i;
+		}
+		else if (strcmp(argv[i], "checkerboard") == 0) {
+			config->test_pattern = TEST_CHECKERBOARD;
+			++i;
+		}
+		else if (strcmp(argv[i], "user") == 0) {
+			if (i + 1 >= argc) {
+				return STATUS_FAILURE;
+			}
+			config->test_pattern = TEST_USER;
+			config->test_value = (uint16_t)strtoul(argv[i + 1], NULL, 0);
+			i += 2;
 		}
 	}
+	if (i < argc) {
+		if (parse_length(argv[i], config) != STATUS_SUCCESS) {
+			return STATUS_FAILURE;
+		}
+		++i;
+	}
+
+	return i == argc ? STATUS_SUCCESS : STATUS_FAILURE;
+}
+
+static ERROR_STATUS parse_trigger_mode(const char* arg, Config* config) {
+	// <s|t>_<rising|falling|high|low>
+	static const char* modes[] = {
+		"s_rising", "s_falling", "s_high", "s_low",
+		"t_rising", "t_falling", "t_high", "t_low",
+	};
+	static const RI_TRIGGER_MODE_t values[] = {
+		RI_TRIG_S_RISING, RI_TRIG_S_FALLING, RI_TRIG_S_HIGH, RI_TRIG_S_LOW,
+		RI_TRIG_T_RISING, RI_TRIG_T_FALLING, RI_TRIG_T_HIGH, RI_TRIG_T_LOW,
+	};
+	for (int k = 0; k < (int)(sizeof(modes) / sizeof(modes[0])); ++k) {
+		if (strcmp(arg, modes[k]) == 0) {
+			config->trigger_mode = values[k];
+			return STATUS_SUCCESS;
+		}
+	}
+	return STATUS_FAILURE;
+}
+
+static ERROR_STATUS parse_gate(int argc, char* argv[], Config* config) {
+	// gate <s|t>_<rising|falling|high|low> [pre] [post] [n_samples]
+	if (argc < 3 || argc > 6) {
+		return STATUS_FAILURE;
+	}
+
+	const int found = parse_trigger_mode(argv[2], config) == STATUS_SUCCESS;
+	if (argc > 3) {
+		config->pre_trigger = strtoul(argv[3], NULL, 0);
+	}
+	if (argc > 4) {
+		config->post_trigger = strtoul(argv[4], NULL, 0);
+	}
+	if (argc > 5) {
+		if (parse_length(argv[5], config) != STATUS_SUCCESS) {
+			return STATUS_FAILURE;
+		}
+	}
+
+	return found && config->pre_trigger + config->post_trigger > 0 ? STATUS_SUCCESS : STATUS_FAILURE;
+}
+
+static ERROR_STATUS parse_analyze(int argc, char* argv[], Config* config) {
+	// analyze <file> <counter|histogram|stats|psd> [nfft]
+	if (argc < 4 || argc > 5) {
+		return STATUS_FAILURE;
+	}
+	config->input_path = argv[2];
+
+	if (strcmp(argv[3], "counter") == 0) {
+		config->analysis_kernel = ANALYSIS_COUNTER;
+	}
+	else if (strcmp(argv[3], "histogram") == 0) {
+		config->analysis_kernel = ANALYSIS_HISTOGRAM;
+	}
+	else if (strcmp(argv[3], "stats") == 0) {
+		config->analysis_kernel = ANALYSIS_STATS;
+	}
+	else if (strcmp(argv[3], "psd") == 0) {
+		config->analysis_kernel = ANALYSIS_PSD;
+	}
 	else {
 		return STATUS_FAILURE;
 	}
+	if (argc == 5) {
+		config->nfft = strtoul(argv[4], NULL, 0);
+	}
 
+	// nfft has to be a power of two that divides the slice alignment of the analyzer
+	if (config->nfft < 2 || config->nfft > (1 << 20) || (config->nfft & (config->nfft - 1)) != 0) {
+		return STATUS_FAILURE;
+	}
 	return STATUS_SUCCESS;
 }
+
+static ERROR_STATUS parse_preview(int argc, char* argv[], Config* config) {
+	// preview [width] [window] [n_samples] [auto|level]
+	if (argc > 6) {
+		return STATUS_FAILURE;
+	}
+	if (argc > 2) {
+		config->preview_width = strtoul(argv[2], NULL, 0);
+	}
+	if (argc > 3) {
+		if (parse_samples_or_duration(argv[3], &config->preview_window) != STATUS_SUCCESS) {
+			return STATUS_FAILURE;
+		}
+	}
+	if (argc > 4) {
+		if (parse_length(argv[4], config) != STATUS_SUCCESS) {
+			return STATUS_FAILURE;
+		}
+	}
+	if (argc > 5 && strcmp(argv[5], "auto") != 0) {
+		config->preview_level = (int)strtol(argv[5], NULL, 0);
+		if (config->preview_level < 0 || config->preview_level >= PREVIEW_LEVELS) {
+			return STATUS_FAILURE;
+		}
+	}
+
+	return config->preview_width > 0 && config->preview_window >= config->preview_width ? STATUS_SUCCESS : STATUS_FAILURE;
+}
+
+static ERROR_STATUS parse_lockin(int argc, char* argv[], Config* config) {
+	// lockin <f1>[,<f2>...] [rate] [iq|polar] [n_samples]
+	if (argc < 3 || argc > 6) {
+		return STATUS_FAILURE;
+	}
+
+	const char* list = argv[2];
+	while (*list != '\0') {
+		char* end;
+		double frequency = strtod(list, &end);
+		// references at or above Nyquist would alias
+		if (end == list || !(frequency >= 0. && frequency < SAMPLE_RATE / 2.)
+			|| config->n_lockin_frequencies == MAX_LOCKIN_FREQUENCIES) {
+			return STATUS_FAILURE;
+		}
+		config->lockin_frequencies[config->n_lockin_frequencies++] = frequency;
+		list = *end == ',' ? end + 1 : end;
+		if (*end != ',' && *end != '\0') {
+			return STATUS_FAILURE;
+		}
+	}
+	if (argc > 3) {
+		config->lockin_rate = strtod(argv[3], NULL);
+	}
+	if (argc > 4) {
+		if (strcmp(argv[4], "polar") == 0) {
+			config->lockin_polar = 1;
+		}
+		else if (strcmp(argv[4], "iq") != 0) {
+			return STATUS_FAILURE;
+		}
+	}
+	if (argc > 5) {
+		if (parse_length(argv[5], config) != STATUS_SUCCESS) {
+			return STATUS_FAILURE;
+		}
+	}
+
+	if (config->n_lockin_frequencies == 0 || !(config->lockin_rate > 0.)) {
+		return STATUS_FAILURE;
+	}
+	// below the output rate the 2f image and the baseline fall into the passband of the output filter
+	for (int r = 0; r < config->n_lockin_frequencies; ++r) {
+		if (config->lockin_frequencies[r] < config->lockin_rate) {
+			return STATUS_FAILURE;
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+static ERROR_STATUS parse_events(int argc, char* argv[], Config* config) {
+	// events <start> <end> [n_samples]
+	if (argc < 4 || argc > 5) {
+		return STATUS_FAILURE;
+	}
+	config->event_start = (int)strtol(argv[2], NULL, 0);
+	config->event_end = (int)strtol(argv[3], NULL, 0);
+	if (argc > 4) {
+		if (parse_length(argv[4], config) != STATUS_SUCCESS) {
+			return STATUS_FAILURE;
+		}
+	}
+
+	if (config->event_start < 0 || config->event_start > SAMPLE_DATA_MASK
+		|| config->event_end < 0 || config->event_end > SAMPLE_DATA_MASK) {
+		return STATUS_FAILURE;
+	}
+	return STATUS_SUCCESS;
+}
+
+static ERROR_STATUS parse_feedback(int argc, char* argv[], Config* config) {
+	// feedback <alarm|bangbang> <a|b> <setpoint> [n_samples]
+	// feedback pi <a|b> <setpoint> <kp> <ki> [n_samples]
+	if (argc < 5) {
+		return STATUS_FAILURE;
+	}
+	int i = 5;
+	if (strcmp(argv[2], "alarm") == 0) {
+		config->feedback_mode = FEEDBACK_ALARM;
+	}
+	else if (strcmp(argv[2], "bangbang") == 0) {
+		config->feedback_mode = FEEDBACK_BANGBANG;
+	}
+	else if (strcmp(argv[2], "pi") == 0 && argc >= 7) {
+		config->feedback_mode = FEEDBACK_PI;
+		config->feedback_kp = strtod(argv[5], NULL);
+		config->feedback_ki = strtod(argv[6], NULL);
+		i = 7;
+	}
+	else {
+		return STATUS_FAILURE;
+	}
+
+	if (strcmp(argv[3], "a") == 0) {
+		config->feedback_port = RI_PORT_A;
+	}
+	else if (strcmp(argv[3], "b") == 0) {
+		config->feedback_port = RI_PORT_B;
+	}
+	else {
+		return STATUS_FAILURE;
+	}
+	config->feedback_setpoint = strtod(argv[4], NULL);
+
+	if (i < argc) {
+		if (parse_length(argv[i], config) != STATUS_SUCCESS) {
+			return STATUS_FAILURE;
+		}
+		++i;
+	}
+	return i == argc ? STATUS_SUCCESS : STATUS_FAILURE;
+}
+
+static ERROR_STATUS parse_correlation(int argc, char* argv[], Config* config) {
+	// correlation [max_lag] [n_samples]
+	if (argc > 4) {
+		return STATUS_FAILURE;
+	}
+	if (argc > 2) {
+		config->max_lag = strtoul(argv[2], NULL, 0);
+	}
+	if (argc > 3) {
+		if (parse_length(argv[3], config) != STATUS_SUCCESS) {
+			return STATUS_FAILURE;
+		}
+	}
+	return config->max_lag > 0 && config->max_lag <= MAX_CORRELATION_LAG ? STATUS_SUCCESS : STATUS_FAILURE;
+}
+
+static ERROR_STATUS parse_record(int argc, char* argv[], Config* config) {
+	// record <path> [length] [segment_mb]
+	if (argc < 3 || argc > 5) {
+		return STATUS_FAILURE;
+	}
+	config->output_path = argv[2];
+	if (argc > 3) {
+		if (parse_length(argv[3], config) != STATUS_SUCCESS) {
+			return STATUS_FAILURE;
+		}
+	}
+	if (argc > 4) {
+		config->segment_samples = strtoull(argv[4], NULL, 0) * (1 << 20) / sizeof(uint16_t);
+	}
+	return config->segment_samples > 0 ? STATUS_SUCCESS : STATUS_FAILURE;
+}
+
+static ERROR_STATUS parse_locate(int argc, char* argv[], Config* config) {
+	// locate <path> <sample|@unix_time>
+	if (argc != 4) {
+		return STATUS_FAILURE;
+	}
+	config->input_path = argv[2];
+	if (argv[3][0] == '@') {
+		// <seconds>[.<fraction>] parsed as integers, a double would lose the nanoseconds
+		const char* arg = argv[3] + 1;
+		char* end;
+		if (*arg < '0' || *arg > '9') {
+			return STATUS_FAILURE;
+		}
+		const long long seconds = strtoll(arg, &end, 10);
+		long long nanoseconds = 0;
+		if (*end == '.') {
+			long long scale = 100000000;
+			for (++end; *end >= '0' && *end <= '9'; ++end) {
+				nanoseconds += (*end - '0') * scale;
+				scale /= 10;
+			}
+		}
+		if (*end != '\0') {
+			return STATUS_FAILURE;
+		}
+		config->locate_by_time = 1;
+		config->locate_time_ns = seconds * 1000000000 + nanoseconds;
+	}
+	else {
+		config->locate_sample = strtoull(argv[3], NULL, 0);
+	}
+	return STATUS_SUCCESS;
+}
+
+static ERROR_STATUS parse_burst(int argc, char* argv[], Config* config) {
+	// burst <length> [chunk] [auto|<s|t>_<rising|falling|high|low>] [path]
+	if (argc < 3 || argc > 6) {
+		return STATUS_FAILURE;
+	}
+	if (parse_length(argv[2], config) != STATUS_SUCCESS) {
+		return STATUS_FAILURE;
+	}
+	if (argc > 3) {
+		config->burst_chunk = strtoull(argv[3], NULL, 0);
+	}
+	if (argc > 4 && strcmp(argv[4], "auto") != 0) {
+		if (parse_trigger_mode(argv[4], config) != STATUS_SUCCESS) {
+			return STATUS_FAILURE;
+		}
+	}
+	if (argc > 5) {
+		config->output_path = argv[5];
+	}
+	return config->burst_chunk > 0 && config->burst_chunk <= (1ull << 31) ? STATUS_SUCCESS : STATUS_FAILURE;
+}
+
+static ERROR_STATUS parse_samples(int argc, char* argv[], Config* config) {
+	// <type> [n_samples]
+	if (argc > 3) {
+		return STATUS_FAILURE;
+	}
+	if (argc == 3) {
+		if (parse_length(argv[2], config) != STATUS_SUCCESS) {
+			return STATUS_FAILURE;
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+ERROR_STATUS parse_config(int argc, char* argv[], Config* config) {
+	// default settings if no args are given
+	config->measurement_type = COUNTER;
+	config->n_samples = 80 * 1000 * 1000;	// 1s of measurement time
+	config->report_interval = 80 * 1000 * 1000;
+	config->test_pattern = TEST_PN9;
+	config->test_value = 0;
+	config->trigger_mode = RI_TRIG_AUTO;
+	config->pre_trigger = 100;
+	config->post_trigger = 900;
+	config->input_path = NULL;
+	config->analysis_kernel = ANALYSIS_COUNTER;
+	config->nfft = 4096;
+	config->preview_width = 1000;
+	config->preview_window = 80 * 1000 * 1000;
+	config->preview_level = -1;
+	config->n_lockin_frequencies = 0;
+	config->lockin_rate = 1000.;
+	config->lockin_polar = 0;
+	config->event_start = 0;
+	config->event_end = 0;
+	config->feedback_mode = FEEDBACK_ALARM;
+	config->feedback_port = RI_PORT_A;
+	config->feedback_setpoint = 0.;
+	config->feedback_kp = 0.;
+	config->feedback_ki = 0.;
+	config->max_lag = 1024;
+	config->output_path = NULL;
+	config->segment_samples = 512 * 1024 * 1024;	// 1 GiB segments
+	config->locate_by_time = 0;
+	config->locate_sample = 0;
+	config->locate_time_ns = 0;
+	config->burst_chunk = 64 * 1024 * 1024;	// 128 MiB per buffer
+
+	if (argc == 1) {
+		return STATUS_SUCCESS;
+	}
+
+	if (strcmp(argv[1], "counter") == 0) {
+		config->measurement_type = COUNTER;
+		return parse_samples(argc, argv, config);
+	}
+	if (strcmp(argv[1], "histogram") == 0) {
+		config->measurement_type = HISTOGRAM;
+		return parse_samples(argc, argv, config);
+	}
+	if (strcmp(argv[1], "selftest") == 0) {
+		config->measurement_type = SELFTEST;
+		config->n_samples = 10 * 80 * 1000 * 1000;	// 10s of measurement time
+		return parse_selftest(argc, argv, config);
+	}
+	if (strcmp(argv[1], "allan") == 0) {
+		config->measurement_type = ALLAN;
+		config->n_samples = 0;
+		return parse_samples(argc, argv, config);
+	}
+	if (strcmp(argv[1], "gate") == 0) {
+		config->measurement_type = GATE;
+		config->n_samples = 0;
+		return parse_gate(argc, argv, config);
+	}
+	if (strcmp(argv[1], "analyze") == 0) {
+		config->measurement_type = ANALYZE;
+		return parse_analyze(argc, argv, config);
+	}
+	if (strcmp(argv[1], "preview") == 0) {
+		config->measurement_type = PREVIEW;
+		config->n_samples = 0;
+		return parse_preview(argc, argv, config);
+	}
+	if (strcmp(argv[1], "lockin") == 0) {
+		config->measurement_type = LOCKIN;
+		config->n_samples = 0;
+		return parse_lockin(argc, argv, config);
+	}
+	if (strcmp(argv[1], "events") == 0) {
+		config->measurement_type = EVENTS;
+		config->n_samples = 0;
+		return parse_events(argc, argv, config);
+	}
+	if (strcmp(argv[1], "feedback") == 0) {
+		config->measurement_type = FEEDBACK;
+		config->n_samples = 0;
+		return parse_feedback(argc, argv, config);
+	}
+	if (strcmp(argv[1], "correlation") == 0) {
+		config->measurement_type = CORRELATION;
+		config->n_samples = 0;
+		return parse_correlation(argc, argv, config);
+	}
+	if (strcmp(argv[1], "record") == 0) {
+		config->measurement_type = RECORD;
+		config->n_samples = 0;
+		return parse_record(argc, argv, config);
+	}
+	if (strcmp(argv[1], "locate") == 0) {
+		config->measurement_type = LOCATE;
+		return parse_locate(argc, argv, config);
+	}
+	if (strcmp(argv[1], "burst") == 0) {
+		config->measurement_type = BURST;
+		return parse_burst(argc, argv, config);
+	}
+
+	return STATUS_FAILURE;
+}
@@ -1,16 +1,103 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <stdint.h>
+#include "ri.h"
 #include "libdpd80.h"
 
 typedef enum measurement_type {
 	COUNTER,
 	HISTOGRAM,
+	SELFTEST,
+	ALLAN,
+	GATE,
+	ANALYZE,
+	PREVIEW,
+	LOCKIN,
+	EVENTS,
+	FEEDBACK,
+	CORRELATION,
+	RECORD,
+	LOCATE,
+	BURST,
 } MeasurementType;
 
+#define MAX_LOCKIN_FREQUENCIES 32
+#define MAX_CORRELATION_LAG 65536		// samples, bounded by the FFT throughput of the workers
+#define PREVIEW_LEVELS 6				// levels of the preview envelope pyramid
+
+typedef enum test_pattern {
+	TEST_PN9,
+	TEST_CHECKERBOARD,
+	TEST_USER,
+} TestPattern;
+
+typedef enum analysis_kernel {
+	ANALYSIS_COUNTER,
+	ANALYSIS_HISTOGRAM,
+	ANALYSIS_STATS,
+	ANALYSIS_PSD,
+} AnalysisKernel;
+
+typedef enum feedback_mode {
+	FEEDBACK_ALARM,
+	FEEDBACK_BANGBANG,
+	FEEDBACK_PI,
+} FeedbackMode;
+
 typedef struct config {
 	MeasurementType measurement_type;
-	unsigned long n_samples;
+	unsigned long long n_samples;	// 0 runs until Ctrl+C where supported
+	unsigned long report_interval;	// samples between two periodic reports
+
+	// selftest
+	TestPattern test_pattern;
+	uint16_t test_value;
+
+	// gate
+	RI_TRIGGER_MODE_t trigger_mode;
+	unsigned long pre_trigger;
+	unsigned long post_trigger;
+
+	// analyze
+	const char* input_path;
+	AnalysisKernel analysis_kernel;
+	unsigned long nfft;
+
+	// preview
+	unsigned long preview_width;	// pixels per frame
+	unsigned long long preview_window;	// samples per frame
+	int preview_level;				// pyramid level to draw from, -1 picks it per frame
+
+	// lockin
+	double lockin_frequencies[MAX_LOCKIN_FREQUENCIES];
+	int n_lockin_frequencies;
+	double lockin_rate;				// outputs per second
+	int lockin_polar;				// R / theta instead of I / Q
+
+	// events, thresholds in ADC codes
+	int event_start;
+	int event_end;
+
+	// feedback
+	FeedbackMode feedback_mode;
+	RI_PORT_t feedback_port;
+	double feedback_setpoint;		// mean ADC code
+	double feedback_kp;				// duty cycle per code
+	double feedback_ki;				// duty cycle per code and second
+
+	// correlation
+	unsigned long max_lag;			// samples
+
+	// record, locate uses input_path
+	const char* output_path;
+	unsigned long long segment_samples;
+	int locate_by_time;
+	unsigned long long locate_sample;
+	long long locate_time_ns;		// since 1970-01-01 UTC
+
+	// burst, uses trigger_mode and optionally output_path
+	unsigned long long burst_chunk;	// samples per sub-capture
 } Config;
 
 ERROR_STATUS parse_config(int argc, char* argv[], Config* config);
@@ -0,0 +1,432 @@
+/*
+	Streaming intensity autocorrelation g2(tau) = <I(t) I(t + tau)> / <I>^2.
+	The intensity is the ADC code plus the calibration offset b / m of the device, the slope cancels in g2.
+
+	Lags below CORRELATION_DIRECT are accumulated directly on every sample with SSE2 in double precision in the callback.
+	All lags up to the block length B are accumulated blockwise with FFTs of length 2B by worker threads:
+	for block k the spectrum conj(FFT([x_k, 0])) * FFT([x_k, x_k+1]) holds sum x_k(t) x(t + tau) for 0 <= tau <= B.
+	Both transforms come from a single complex FFT of ([x_k, 0] + i [x_k, x_k+1]), and the spectra are summed,
+	so only one inverse FFT is needed per report. The callback only copies samples into a ring of blocks; if the
+	workers fall behind, blocks are dropped from the FFT path (reported) instead of stalling the transfer.
+	Reports are printed by a worker from a snapshot of the direct sums, the callback never runs the inverse FFT.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <windows.h>
+#include <emmintrin.h>
+#include "ri.h"
+#include "callbacks.h"
+#include "fft.h"
+#include "correlation.h"
+
+#define CORRELATION_DIRECT 8			// lags computed directly on every sample
+#define CORRELATION_RING 64				// blocks buffered for the workers
+#define CORRELATION_MAX_THREADS 16
+
+typedef struct correlation_sums {
+	int64_t samples_seen;
+	double direct[CORRELATION_DIRECT];
+	unsigned long long direct_n[CORRELATION_DIRECT];
+	double sum;
+	unsigned long long count;
+} CorrelationSums;
+
+typedef struct correlation_worker {
+	struct correlation_state* state;
+	HANDLE thread;
+	CRITICAL_SECTION lock;				// protects the accumulated spectrum
+	double* spectrum_re;
+	double* spectrum_im;
+	double* re;							// FFT buffers of the worker
+	double* im;
+	unsigned long long blocks;
+} CorrelationWorker;
+
+typedef struct correlation_state {
+	int64_t samples_left;
+	int unlimited;
+	int64_t report_interval;
+	int64_t report_next;
+	int max_lag;
+	float offset;						// calibration offset in ADC codes
+
+	// direct lags
+	double* scratch;
+	int scratch_size;
+	double tail[CORRELATION_DIRECT];
+	int n_tail;
+	CorrelationSums sums;
+
+	// FFT path
+	int block;
+	FftPlan* plan;
+	uint16_t* ring;						// CORRELATION_RING blocks of block samples
+	int* gap;							// a block was dropped in front of this one
+	int* done;
+	int64_t produced;					// blocks written into the ring
+	int64_t next_job;
+	int64_t completed;					// jobs 0 .. completed - 1 are done
+	int filling;						// samples in the block being written
+	int dropping;						// the block being received is discarded
+	int pending_gap;
+	unsigned long long blocks_dropped;
+	int stop;
+	CorrelationSums report;				// snapshot for the next report
+	int report_pending;					// a worker prints the report, not the transfer callback
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE jobs_available;
+	CorrelationWorker workers[CORRELATION_MAX_THREADS];
+	int n_workers;
+
+	unsigned long long dataloss_events;
+} CorrelationState;
+
+static void correlate_job(CorrelationState* state, CorrelationWorker* worker, int64_t k, double* re, double* im) {
+	const int b = state->block;
+	const uint16_t* x0 = state->ring + (k % CORRELATION_RING) * b;
+	const uint16_t* x1 = state->ring + ((k + 1) % CORRELATION_RING) * b;
+
+	for (int t = 0; t < b; ++t) {
+		const double x = (x0[t] & SAMPLE_DATA_MASK) + state->offset;
+		re[t] = x;
+		im[t] = x;
+		re[b + t] = 0.;
+		im[b + t] = (x1[t] & SAMPLE_DATA_MASK) + state->offset;
+	}
+	fft_forward(state->plan, re, im);
+
+	// A = FFT([x_k, 0]), W = FFT([x_k, x_k+1]), accumulate conj(A) W
+	const int n = 2 * b;
+	EnterCriticalSection(&worker->lock);
+	for (int f = 0; f < n; ++f) {
+		const int m = (n - f) & (n - 1);
+		const double ar = 0.5 * (re[f] + re[m]);
+		const double ai = 0.5 * (im[f] - im[m]);
+		const double wr = 0.5 * (im[f] + im[m]);
+		const double wi = -0.5 * (re[f] - re[m]);
+		worker->spectrum_re[f] += ar * wr + ai * wi;
+		worker->spectrum_im[f] += ar * wi - ai * wr;
+	}
+	worker->blocks++;
+	LeaveCriticalSection(&worker->lock);
+}
+
+/*
+	Merge the worker spectra, transform back and print tau;g2 for all lags. re and im hold 2 * block values.
+*/
+static void correlation_report(CorrelationState* state, const CorrelationSums* sums, double* re, double* im) {
+	const int n = 2 * state->block;
+	unsigned long long blocks = 0;
+
+	memset(re, 0, n * sizeof(double));
+	memset(im, 0, n * sizeof(double));
+	for (int w = 0; w < state->n_workers; ++w) {
+		CorrelationWorker* worker = &state->workers[w];
+		EnterCriticalSection(&worker->lock);
+		for (int f = 0; f < n; ++f) {
+			re[f] += worker->spectrum_re[f];
+			im[f] += worker->spectrum_im[f];
+		}
+		blocks += worker->blocks;
+		LeaveCriticalSection(&worker->lock);
+	}
+	fft_inverse(state->plan, re, im);
+
+	// both paths are normalized by the mean over every sample
+	const double mean = sums->count ? sums->sum / sums->count : 0.;
+	for (int tau = 0; tau <= state->max_lag; ++tau) {
+		double g2 = 0.;
+		if (tau < CORRELATION_DIRECT) {
+			if (sums->direct_n[tau] > 0 && mean != 0.)
+				g2 = sums->direct[tau] / sums->direct_n[tau] / (mean * mean);
+		}
+		else if (blocks > 0 && mean != 0.) {
+			g2 = re[tau] / n / ((double)blocks * state->block) / (mean * mean);
+		}
+		printf("DATA: %lld;%.6g;%.9f\n", sums->samples_seen, (double)tau / SAMPLE_RATE, g2);
+	}
+}
+
+static DWORD WINAPI correlation_thread(LPVOID param) {
+	CorrelationWorker* worker = (CorrelationWorker*)param;
+	CorrelationState* state = worker->state;
+
+	EnterCriticalSection(&state->lock);
+	for (;;) {
+		while (!state->stop && !state->report_pending && state->next_job + 1 >= state->produced)
+			SleepConditionVariableCS(&state->jobs_available, &state->lock, INFINITE);
+		if (state->report_pending) {
+			const CorrelationSums sums = state->report;
+			state->report_pending = 0;
+			LeaveCriticalSection(&state->lock);
+			correlation_report(state, &sums, worker->re, worker->im);
+			EnterCriticalSection(&state->lock);
+			continue;
+		}
+		if (state->next_job + 1 >= state->produced)
+			break;
+
+		const int64_t k = state->next_job++;
+		const int skip = state->gap[(k + 1) % CORRELATION_RING];
+		LeaveCriticalSection(&state->lock);
+
+		if (!skip)
+			correlate_job(state, worker, k, worker->re, worker->im);
+
+		EnterCriticalSection(&state->lock);
+		state->done[k % CORRELATION_RING] = 1;
+		while (state->completed < state->next_job && state->done[state->completed % CORRELATION_RING]) {
+			state->done[state->completed % CORRELATION_RING] = 0;
+			state->completed++;
+		}
+	}
+	LeaveCriticalSection(&state->lock);
+	return 0;
+}
+
+/*
+	Copy the chunk into the block ring. A new block is only started if the workers released its slot,
+	i.e. jobs up to produced - CORRELATION_RING are done (job k reads blocks k and k + 1).
+*/
+static void correlation_produce(CorrelationState* state, const uint16_t* data, int ndata) {
+	const int b = state->block;
+	int i = 0;
+
+	while (i < ndata) {
+		if (state->filling == 0 && !state->dropping) {
+			EnterCriticalSection(&state->lock);
+			const int free_slot = state->completed > state->produced - CORRELATION_RING;
+			LeaveCriticalSection(&state->lock);
+			if (!free_slot) {
+				state->dropping = 1;
+				state->blocks_dropped++;
+				state->pending_gap = 1;
+			}
+		}
+
+		int n = b - state->filling;
+		if (n > ndata - i)
+			n = ndata - i;
+		if (!state->dropping)
+			memcpy(state->ring + (state->produced % CORRELATION_RING) * b + state->filling, data + i, n * sizeof(uint16_t));
+		state->filling += n;
+		i += n;
+
+		if (state->filling == b) {
+			state->filling = 0;
+			if (state->dropping) {
+				state->dropping = 0;
+				continue;
+			}
+			EnterCriticalSection(&state->lock);
+			state->gap[state->produced % CORRELATION_RING] = state->pending_gap;
+			state->produced++;
+			LeaveCriticalSection(&state->lock);
+			WakeConditionVariable(&state->jobs_available);
+			state->pending_gap = 0;
+		}
+	}
+}
+
+/*
+	Lags 0 .. CORRELATION_DIRECT - 1 over every sample, continued across chunks with the last samples of the previous chunk.
+*/
+static int correlation_direct(CorrelationState* state, const uint16_t* data, int ndata) {
+	const int n = state->n_tail + ndata;
+	if (n > state->scratch_size) {
+		double* scratch = realloc(state->scratch, 2 * n * sizeof(double));
+		if (scratch == NULL)
+			return 0;
+		state->scratch = scratch;
+		state->scratch_size = 2 * n;
+	}
+	double* s = state->scratch;
+	memcpy(s, state->tail, state->n_tail * sizeof(double));
+	for (int i = 0; i < ndata; ++i) {
+		s[state->n_tail + i] = (data[i] & SAMPLE_DATA_MASK) + state->offset;
+	}
+
+	// products s[j] * s[j + d] for every j whose partner s[j + d] is new in this chunk
+	for (int d = 0; d < CORRELATION_DIRECT; ++d) {
+		int j = state->n_tail - d > 0 ? state->n_tail - d : 0;
+		const int end = n - d;
+		__m128d acc0 = _mm_setzero_pd();
+		__m128d acc1 = _mm_setzero_pd();
+		double sum = 0.;
+		if (end <= j)
+			continue;
+		state->sums.direct_n[d] += end - j;
+		for (; j + 4 <= end; j += 4) {
+			acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(s + j), _mm_loadu_pd(s + j + d)));
+			acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(s + j + 2), _mm_loadu_pd(s + j + d + 2)));
+		}
+		for (; j < end; ++j) {
+			sum += s[j] * s[j + d];
+		}
+		double lanes[2];
+		_mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+		state->sums.direct[d] += lanes[0] + lanes[1] + sum;
+	}
+	for (int i = state->n_tail; i < n; ++i) {
+		state->sums.sum += s[i];
+	}
+	state->sums.count += ndata;
+
+	state->n_tail = n < CORRELATION_DIRECT ? n : CORRELATION_DIRECT;
+	memcpy(state->tail, s + n - state->n_tail, state->n_tail * sizeof(double));
+	return 1;
+}
+
+/*
+	Accumulate the direct lags and hand the samples to the FFT workers.
+*/
+int callback_correlation(uint16_t* data, int ndata, int dataloss, void* userdata)
+{
+	CorrelationState* state = (CorrelationState*)userdata;
+
+	if (dataloss) {
+		printf("ERR!: DATA LOSS DETECTED\n");
+		state->dataloss_events++;
+		state->pending_gap = 1;
+	}
+
+	if (!correlation_direct(state, data, ndata)) {
+		printf("ERR!: OUT OF MEMORY\n");
+		return 0;
+	}
+	correlation_produce(state, data, ndata);
+
+	state->sums.samples_seen += ndata;
+	if (state->sums.samples_seen >= state->report_next) {
+		// a report still pending is replaced by the newer one
+		EnterCriticalSection(&state->lock);
+		state->report = state->sums;
+		state->report_pending = 1;
+		LeaveCriticalSection(&state->lock);
+		WakeConditionVariable(&state->jobs_available);
+		state->report_next += state->report_interval;
+	}
+
+	return samples_remaining(&state->samples_left, ndata, state->unlimited);
+}
+
+/*
+	Calibration offset b / m in ADC codes, zero if the device has no valid calibration.
+*/
+static float calibration_offset(ri_device* device) {
+	const ri_calibration_t calibration = ri_get_calibration(device, RI_CALIBRATION_DIGITAL_AUTO);
+	if (ri_is_bad_calibration(calibration) || calibration.m == 0.f) {
+		printf("ERR!: NO CALIBRATION, USING RAW CODES\n");
+		return 0.f;
+	}
+	return calibration.b / calibration.m;
+}
+
+static void correlation_free(CorrelationState* state) {
+	for (int w = 0; w < state->n_workers; ++w) {
+		DeleteCriticalSection(&state->workers[w].lock);
+		free(state->workers[w].spectrum_re);
+		free(state->workers[w].spectrum_im);
+		free(state->workers[w].re);
+		free(state->workers[w].im);
+	}
+	DeleteCriticalSection(&state->lock);
+	fft_destroy(state->plan);
+	free(state->ring);
+	free(state->gap);
+	free(state->done);
+	free(state->scratch);
+	free(state);
+}
+
+/*
+	Run the correlation measurement up to config->max_lag samples of lag.
+*/
+ERROR_STATUS run_correlation(ri_device* device, const Config* config) {
+	CorrelationState* state = calloc(1, sizeof(CorrelationState));
+	if (state == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		return STATUS_FAILURE;
+	}
+	InitializeCriticalSection(&state->lock);
+	InitializeConditionVariable(&state->jobs_available);
+	state->samples_left = config->n_samples;
+	state->unlimited = config->n_samples == 0;
+	state->report_interval = config->report_interval;
+	state->report_next = config->report_interval;
+	state->max_lag = (int)config->max_lag;
+	state->offset = calibration_offset(device);
+
+	state->block = 1024;
+	while (state->block < state->max_lag)
+		state->block *= 2;
+	state->plan = fft_create(2 * state->block);
+	state->ring = malloc((size_t)CORRELATION_RING * state->block * sizeof(uint16_t));
+	state->gap = calloc(CORRELATION_RING, sizeof(int));
+	state->done = calloc(CORRELATION_RING, sizeof(int));
+
+	// leave one core for the transfer callback
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int n_workers = (int)info.dwNumberOfProcessors - 1;
+	if (n_workers < 1)
+		n_workers = 1;
+	if (n_workers > CORRELATION_MAX_THREADS)
+		n_workers = CORRELATION_MAX_THREADS;
+	int allocated = 1;
+	for (int w = 0; w < n_workers; ++w) {
+		CorrelationWorker* worker = &state->workers[w];
+		worker->state = state;
+		worker->spectrum_re = calloc(2 * state->block, sizeof(double));
+		worker->spectrum_im = calloc(2 * state->block, sizeof(double));
+		worker->re = malloc(2 * state->block * sizeof(double));
+		worker->im = malloc(2 * state->block * sizeof(double));
+		InitializeCriticalSection(&worker->lock);
+		state->n_workers++;
+		allocated = allocated && worker->spectrum_re != NULL && worker->spectrum_im != NULL
+			&& worker->re != NULL && worker->im != NULL;
+	}
+	if (!allocated || state->plan == NULL || state->ring == NULL || state->gap == NULL || state->done == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		correlation_free(state);
+		return STATUS_FAILURE;
+	}
+	for (int w = 0; w < n_workers; ++w) {
+		state->workers[w].thread = CreateThread(NULL, 0, correlation_thread, &state->workers[w], 0, NULL);
+	}
+
+	install_stop_handler();
+
+	printf("META: REQUEST CORRELATION SAMPLES %llu\n", config->n_samples);
+	printf("META: MAX LAG %d BLOCK %d THREADS %d\n", state->max_lag, state->block, n_workers);
+	printf("META: CALIBRATION OFFSET / codes %g\n", state->offset);
+	printf("META: START_OF_STREAM\n");
+	double initial_time = (double)clock() / CLOCKS_PER_SEC;
+	int err = ri_start_continuous_transfer(device, callback_correlation, state);
+	double final_time = (double)clock() / CLOCKS_PER_SEC;
+
+	EnterCriticalSection(&state->lock);
+	state->stop = 1;
+	LeaveCriticalSection(&state->lock);
+	WakeAllConditionVariable(&state->jobs_available);
+	for (int w = 0; w < n_workers; ++w) {
+		if (state->workers[w].thread != NULL) {
+			WaitForSingleObject(state->workers[w].thread, INFINITE);
+			CloseHandle(state->workers[w].thread);
+		}
+	}
+	correlation_report(state, &state->sums, state->workers[0].re, state->workers[0].im);
+	printf("META: END_OF_STREAM\n");
+
+	remove_stop_handler();
+
+	print_transfer_summary(state->sums.samples_seen, final_time - initial_time);
+	printf("META: FFT BLOCKS DROPPED %llu\n", state->blocks_dropped);
+	printf("META: DATA LOSS EVENTS %llu\n", state->dataloss_events);
+
+	correlation_free(state);
+	return err == 0 ? STATUS_SUCCESS : STATUS_FAILURE;
+}
@@ -0,0 +1,11 @@
+#ifndef CORRELATION_H
+#define CORRELATION_H
+
+#include "ri.h"
+#include "config.h"
+#include "libdpd80.h"
+
+ERROR_STATUS run_correlation(ri_device* device, const Config* config);
+int callback_correlation(uint16_t* data, int ndata, int dataloss, void* userdata);
+
+#endif
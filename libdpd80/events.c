@@ -0,0 +1,210 @@
+/*
+	Pulse detection with hysteresis.
+	An event starts when a sample reaches the start threshold and ends at the first sample below the end threshold.
+	If the start threshold is lower than the end threshold, negative going pulses are detected instead; internally
+	those samples are mirrored (x ^ SAMPLE_DATA_MASK), so both polarities share the same code.
+	The baseline between events is skipped with an SSE2 scan, only samples inside events are looked at individually.
+	Events that span chunk boundaries are continued in the next chunk.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <emmintrin.h>
+#include "ri.h"
+#include "callbacks.h"
+#include "events.h"
+
+typedef struct events_state {
+	int64_t samples_left;
+	int unlimited;
+	int64_t stream_index;		// absolute index of data[0]
+
+	uint16_t flip;				// 0 for positive pulses, SAMPLE_DATA_MASK for negative pulses
+	int start;					// thresholds in the (mirrored) sample domain
+	int end;
+	int previous;				// last sample of the previous chunk, -1 before the first chunk
+
+	int in_event;
+	int64_t event_index;		// first sample at or above the start threshold
+	double event_time;			// interpolated start crossing, in samples
+	int peak;
+	unsigned long long area;	// sum of (x - end) over the event
+
+	unsigned long long events;
+	unsigned long long dataloss_events;
+} EventsState;
+
+/*
+	Index of the first sample from i on that is >= threshold, n if none.
+*/
+static int scan_above(const uint16_t* data, int i, int n, int threshold, uint16_t flip) {
+	const __m128i mask = _mm_set1_epi16(SAMPLE_DATA_MASK);
+	const __m128i vflip = _mm_set1_epi16(flip);
+	const __m128i limit = _mm_set1_epi16((short)(threshold - 1));
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_xor_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), mask), vflip);
+		__m128i b = _mm_xor_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i + 8)), mask), vflip);
+		__m128i hit = _mm_or_si128(_mm_cmpgt_epi16(a, limit), _mm_cmpgt_epi16(b, limit));
+		if (_mm_movemask_epi8(hit) != 0)
+			break;
+	}
+	for (; i < n; ++i) {
+		if (((data[i] & SAMPLE_DATA_MASK) ^ flip) >= threshold)
+			return i;
+	}
+	return n;
+}
+
+/*
+	Accumulate peak and area of the event from data[i] on until the first sample below the end threshold.
+	Returns the index of that sample, n if the event continues into the next chunk.
+*/
+static int scan_event(EventsState* state, const uint16_t* data, int i, int n) {
+	const __m128i mask = _mm_set1_epi16(SAMPLE_DATA_MASK);
+	const __m128i vflip = _mm_set1_epi16(state->flip);
+	const __m128i end = _mm_set1_epi16((short)state->end);
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i vmax = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	int n_vector = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_xor_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), mask), vflip);
+		if (_mm_movemask_epi8(_mm_cmplt_epi16(v, end)) != 0)
+			break;
+		__m128i s = _mm_madd_epi16(_mm_sub_epi16(v, end), ones);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(s, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(s, zero));
+		vmax = _mm_max_epi16(vmax, v);
+		n_vector += 8;
+	}
+	if (n_vector > 0) {
+		unsigned long long sums[2];
+		short lanes[8];
+		_mm_storeu_si128((__m128i*)sums, acc);
+		_mm_storeu_si128((__m128i*)lanes, vmax);
+		state->area += sums[0] + sums[1];
+		for (int k = 0; k < 8; ++k) {
+			if (lanes[k] > state->peak)
+				state->peak = lanes[k];
+		}
+	}
+
+	for (; i < n; ++i) {
+		const int x = (data[i] & SAMPLE_DATA_MASK) ^ state->flip;
+		if (x < state->end)
+			return i;
+		state->area += x - state->end;
+		if (x > state->peak)
+			state->peak = x;
+	}
+	return n;
+}
+
+/*
+	Fractional position of the crossing of threshold between the samples before and at index i.
+*/
+static double crossing(int before, int at, int threshold) {
+	if (before < 0 || at == before)
+		return 0.;
+	return (double)(threshold - before) / (at - before) - 1.;
+}
+
+static int sample_before(const EventsState* state, const uint16_t* data, int i) {
+	if (i > 0)
+		return (data[i - 1] & SAMPLE_DATA_MASK) ^ state->flip;
+	return state->previous;
+}
+
+/*
+	Detect all events of the chunk and print index;time;peak;area;width for every completed event.
+*/
+int callback_events(uint16_t* data, int ndata, int dataloss, void* userdata)
+{
+	EventsState* state = (EventsState*)userdata;
+	int i = 0;
+
+	if (dataloss) {
+		printf("ERR!: DATA LOSS DETECTED\n");
+		state->dataloss_events++;
+	}
+
+	while (i < ndata) {
+		if (!state->in_event) {
+			i = scan_above(data, i, ndata, state->start, state->flip);
+			if (i == ndata)
+				break;
+			const int x = (data[i] & SAMPLE_DATA_MASK) ^ state->flip;
+			state->in_event = 1;
+			state->event_index = state->stream_index + i;
+			state->event_time = state->event_index + crossing(sample_before(state, data, i), x, state->start);
+			state->peak = 0;
+			state->area = 0;
+		}
+
+		i = scan_event(state, data, i, ndata);
+		if (i == ndata)
+			break;
+
+		// i is the first sample below the end threshold
+		const int x = (data[i] & SAMPLE_DATA_MASK) ^ state->flip;
+		const double end_time = state->stream_index + i + crossing(sample_before(state, data, i), x, state->end);
+		const int peak = state->flip ? state->peak ^ SAMPLE_DATA_MASK : state->peak;
+		printf("DATA: %lld;%.12g;%d;%llu;%.3f\n", state->event_index, state->event_time / SAMPLE_RATE,
+			peak, state->area, end_time - state->event_time);
+		state->events++;
+		state->in_event = 0;
+	}
+
+	if (ndata > 0)
+		state->previous = (data[ndata - 1] & SAMPLE_DATA_MASK) ^ state->flip;
+	state->stream_index += ndata;
+	return samples_remaining(&state->samples_left, ndata, state->unlimited);
+}
+
+/*
+	Run the event detection with the thresholds of config.
+*/
+ERROR_STATUS run_events(ri_device* device, const Config* config) {
+	EventsState* state = calloc(1, sizeof(EventsState));
+	if (state == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		return STATUS_FAILURE;
+	}
+	state->samples_left = config->n_samples;
+	state->unlimited = config->n_samples == 0;
+	state->previous = -1;
+	if (config->event_start >= config->event_end) {
+		state->flip = 0;
+		state->start = config->event_start;
+		state->end = config->event_end;
+	}
+	else {
+		state->flip = SAMPLE_DATA_MASK;
+		state->start = config->event_start ^ SAMPLE_DATA_MASK;
+		state->end = config->event_end ^ SAMPLE_DATA_MASK;
+	}
+
+	install_stop_handler();
+
+	printf("META: REQUEST EVENTS SAMPLES %llu\n", config->n_samples);
+	printf("META: THRESHOLDS START %d END %d %s\n", config->event_start, config->event_end,
+		state->flip ? "NEGATIVE" : "POSITIVE");
+	printf("META: START_OF_STREAM\n");
+	double initial_time = (double)clock() / CLOCKS_PER_SEC;
+	int err = ri_start_continuous_transfer(device, callback_events, state);
+	double final_time = (double)clock() / CLOCKS_PER_SEC;
+	printf("META: END_OF_STREAM\n");
+
+	remove_stop_handler();
+
+	print_transfer_summary(state->stream_index, final_time - initial_time);
+	printf("META: EVENTS %llu\n", state->events);
+	printf("META: DATA LOSS EVENTS %llu\n", state->dataloss_events);
+
+	free(state);
+	return err == 0 ? STATUS_SUCCESS : STATUS_FAILURE;
+}
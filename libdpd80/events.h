@@ -0,0 +1,11 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include "ri.h"
+#include "config.h"
+#include "libdpd80.h"
+
+ERROR_STATUS run_events(ri_device* device, const Config* config);
+int callback_events(uint16_t* data, int ndata, int dataloss, void* userdata);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+	Closed-loop feedback on port A or B.
+	The only estimator is the mean ADC code of each chunk, computed with one SSE2 pass, so the callback stays cheap.
+	 - alarm: the port is driven high while the mean is above the setpoint
+	 - bangbang: the port is driven high while the mean is below the setpoint
+	 - pi: a PI controller on setpoint - mean sets the PWM duty cycle of the port
+	The port is only written when its output changes. The time from entering the callback with new samples until
+	the port write returned is recorded for every write; the oldest sample of a chunk is ndata / SAMPLE_RATE older.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <windows.h>
+#include "ri.h"
+#include "callbacks.h"
+#include "kernels.h"
+#include "feedback.h"
+
+#define FEEDBACK_PWM_PERIOD 4000		// port clock cycles at ~400 MHz, about 10 us
+#define FEEDBACK_LATENCY_BIN 1e-6		// latency histogram resolution in seconds
+#define FEEDBACK_LATENCY_BINS 100000	// up to 100 ms, slower writes go to the last bin
+
+typedef struct feedback_state {
+	int64_t samples_left;
+	int unlimited;
+	int64_t stream_index;
+	int64_t report_interval;
+	int64_t report_next;
+
+	ri_device* device;
+	RI_PORT_t port;
+	FeedbackMode mode;
+	double setpoint;
+	double kp;
+	double ki;
+
+	double integral;
+	int level;					// driven level, -1 before the first write
+	uint32_t duty;				// PWM on-time in clock cycles, UINT32_MAX before the first write
+	double mean;
+
+	LARGE_INTEGER frequency;
+	unsigned long long* latency;
+	unsigned long long writes;
+	unsigned long long write_errors;
+	double latency_max;
+	double latency_sum;
+	int max_chunk;
+	unsigned long long dataloss_events;
+} FeedbackState;
+
+static void record_latency(FeedbackState* state, const LARGE_INTEGER* arrival) {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	const double latency = (double)(now.QuadPart - arrival->QuadPart) / state->frequency.QuadPart;
+
+	int bin = (int)(latency / FEEDBACK_LATENCY_BIN);
+	if (bin >= FEEDBACK_LATENCY_BINS)
+		bin = FEEDBACK_LATENCY_BINS - 1;
+	state->latency[bin]++;
+	state->latency_sum += latency;
+	if (latency > state->latency_max)
+		state->latency_max = latency;
+	state->writes++;
+}
+
+static double latency_percentile(const FeedbackState* state, double fraction) {
+	const unsigned long long target = (unsigned long long)(fraction * state->writes);
+	unsigned long long count = 0;
+	for (int bin = 0; bin < FEEDBACK_LATENCY_BINS; ++bin) {
+		count += state->latency[bin];
+		if (count > target)
+			return (bin + 1) * FEEDBACK_LATENCY_BIN;
+	}
+	return FEEDBACK_LATENCY_BINS * FEEDBACK_LATENCY_BIN;
+}
+
+/*
+	Estimate the chunk mean and update the port output.
+*/
+int callback_feedback(uint16_t* data, int ndata, int dataloss, void* userdata)
+{
+	LARGE_INTEGER arrival;
+	QueryPerformanceCounter(&arrival);
+	FeedbackState* state = (FeedbackState*)userdata;
+
+	if (dataloss) {
+		printf("ERR!: DATA LOSS DETECTED\n");
+		state->dataloss_events++;
+	}
+	if (ndata == 0)
+		return samples_remaining(&state->samples_left, ndata, state->unlimited);
+
+	state->mean = (double)kernel_sum(data, ndata) / ndata;
+	if (ndata > state->max_chunk)
+		state->max_chunk = ndata;
+
+	if (state->mode == FEEDBACK_PI) {
+		const double error = state->setpoint - state->mean;
+		const double dt = (double)ndata / SAMPLE_RATE;
+		double output = state->kp * error + state->ki * (state->integral + error * dt);
+		// conditional integration, the integral only grows while the output is not saturated
+		if (output > 0. && output < 1.)
+			state->integral += error * dt;
+		if (output < 0.)
+			output = 0.;
+		if (output > 1.)
+			output = 1.;
+
+		const uint32_t duty = (uint32_t)(output * FEEDBACK_PWM_PERIOD + 0.5);
+		if (duty != state->duty) {
+			if (ri_port_pwm(state->device, state->port, duty, FEEDBACK_PWM_PERIOD) != RI_SUCCESS)
+				state->write_errors++;
+			record_latency(state, &arrival);
+			state->duty = duty;
+		}
+	}
+	else {
+		const int level = state->mode == FEEDBACK_ALARM ? state->mean > state->setpoint : state->mean < state->setpoint;
+		if (level != state->level) {
+			if (ri_port_drive(state->device, state->port, level) != RI_SUCCESS)
+				state->write_errors++;
+			record_latency(state, &arrival);
+			state->level = level;
+		}
+	}
+
+	state->stream_index += ndata;
+	if (state->stream_index >= state->report_next) {
+		printf("DATA: %lld;%.3f;%g\n", state->stream_index, state->mean,
+			state->mode == FEEDBACK_PI ? (double)state->duty / FEEDBACK_PWM_PERIOD : (double)state->level);
+		state->report_next += state->report_interval;
+	}
+
+	return samples_remaining(&state->samples_left, ndata, state->unlimited);
+}
+
+/*
+	Run the feedback loop. The port is driven low again when the loop ends.
+*/
+ERROR_STATUS run_feedback(ri_device* device, const Config* config) {
+	FeedbackState* state = calloc(1, sizeof(FeedbackState));
+	unsigned long long* latency = calloc(FEEDBACK_LATENCY_BINS, sizeof(unsigned long long));
+	if (state == NULL || latency == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		free(state);
+		free(latency);
+		return STATUS_FAILURE;
+	}
+	state->samples_left = config->n_samples;
+	state->unlimited = config->n_samples == 0;
+	state->report_interval = config->report_interval;
+	state->report_next = config->report_interval;
+	state->device = device;
+	state->port = config->feedback_port;
+	state->mode = config->feedback_mode;
+	state->setpoint = config->feedback_setpoint;
+	state->kp = config->feedback_kp;
+	state->ki = config->feedback_ki;
+	state->level = -1;
+	state->duty = UINT32_MAX;
+	state->latency = latency;
+	QueryPerformanceFrequency(&state->frequency);
+
+	install_stop_handler();
+
+	printf("META: REQUEST FEEDBACK SAMPLES %llu\n", config->n_samples);
+	printf("META: PORT %c SETPOINT %g\n", state->port == RI_PORT_A ? 'A' : 'B', state->setpoint);
+	printf("META: START_OF_STREAM\n");
+	double initial_time = (double)clock() / CLOCKS_PER_SEC;
+	int err = ri_start_continuous_transfer(device, callback_feedback, state);
+	double final_time = (double)clock() / CLOCKS_PER_SEC;
+	printf("META: END_OF_STREAM\n");
+
+	ri_port_drive(device, state->port, 0);
+	remove_stop_handler();
+
+	print_transfer_summary(state->stream_index, final_time - initial_time);
+	printf("META: PORT WRITES %llu\n", state->writes);
+	printf("META: PORT WRITE ERRORS %llu\n", state->write_errors);
+	if (state->writes > 0) {
+		printf("META: LATENCY MEAN / us %.1f\n", 1e6 * state->latency_sum / state->writes);
+		printf("META: LATENCY P50 / us %.0f\n", 1e6 * latency_percentile(state, 0.5));
+		printf("META: LATENCY P90 / us %.0f\n", 1e6 * latency_percentile(state, 0.9));
+		printf("META: LATENCY P99 / us %.0f\n", 1e6 * latency_percentile(state, 0.99));
+		printf("META: LATENCY MAX / us %.1f\n", 1e6 * state->latency_max);
+	}
+	printf("META: MAX CHUNK AGE / us %.1f\n", 1e6 * state->max_chunk / SAMPLE_RATE);
+	printf("META: DATA LOSS EVENTS %llu\n", state->dataloss_events);
+
+	free(latency);
+	free(state);
+	return err == 0 ? STATUS_SUCCESS : STATUS_FAILURE;
+}
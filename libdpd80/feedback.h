@@ -0,0 +1,11 @@
+#ifndef FEEDBACK_H
+#define FEEDBACK_H
+
+#include "ri.h"
+#include "config.h"
+#include "libdpd80.h"
+
+ERROR_STATUS run_feedback(ri_device* device, const Config* config);
+int callback_feedback(uint16_t* data, int ndata, int dataloss, void* userdata);
+
+#endif
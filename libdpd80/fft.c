@@ -0,0 +1,101 @@
+/*
+	In-place iterative radix-2 complex FFT on split real / imaginary arrays.
+	Twiddle factors and the bit reversal permutation are computed once per plan.
+*/
+
+#include <stdlib.h>
+#include <math.h>
+#include "fft.h"
+
+#define FFT_PI 3.14159265358979323846
+
+/*
+	Create a plan for transforms of length n, n has to be a power of two.
+	Returns NULL if n is invalid or memory runs out.
+*/
+FftPlan* fft_create(int n) {
+	if (n < 2 || (n & (n - 1)) != 0)
+		return NULL;
+
+	FftPlan* plan = calloc(1, sizeof(FftPlan));
+	if (plan == NULL)
+		return NULL;
+	plan->n = n;
+	plan->bitrev = malloc(n * sizeof(int));
+	plan->cos_table = malloc(n / 2 * sizeof(double));
+	plan->sin_table = malloc(n / 2 * sizeof(double));
+	if (plan->bitrev == NULL || plan->cos_table == NULL || plan->sin_table == NULL) {
+		fft_destroy(plan);
+		return NULL;
+	}
+
+	int bits = 0;
+	while ((1 << bits) < n)
+		++bits;
+	for (int i = 0; i < n; ++i) {
+		int r = 0;
+		for (int b = 0; b < bits; ++b) {
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		}
+		plan->bitrev[i] = r;
+	}
+	for (int k = 0; k < n / 2; ++k) {
+		plan->cos_table[k] = cos(2. * FFT_PI * k / n);
+		plan->sin_table[k] = sin(2. * FFT_PI * k / n);
+	}
+	return plan;
+}
+
+void fft_destroy(FftPlan* plan) {
+	if (plan == NULL)
+		return;
+	free(plan->bitrev);
+	free(plan->cos_table);
+	free(plan->sin_table);
+	free(plan);
+}
+
+static void fft_transform(const FftPlan* plan, double* re, double* im, double sign) {
+	const int n = plan->n;
+
+	for (int i = 0; i < n; ++i) {
+		int j = plan->bitrev[i];
+		if (j > i) {
+			double t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+
+	for (int size = 2; size <= n; size <<= 1) {
+		const int half = size / 2;
+		const int step = n / size;
+		for (int start = 0; start < n; start += size) {
+			for (int k = 0; k < half; ++k) {
+				const double wr = plan->cos_table[k * step];
+				const double wi = sign * plan->sin_table[k * step];
+				const int a = start + k;
+				const int b = a + half;
+				const double tr = re[b] * wr - im[b] * wi;
+				const double ti = re[b] * wi + im[b] * wr;
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+}
+
+/*
+	X[k] = sum x[j] exp(-2 pi i j k / n)
+*/
+void fft_forward(const FftPlan* plan, double* re, double* im) {
+	fft_transform(plan, re, im, -1.);
+}
+
+/*
+	Unnormalized inverse, x[j] = sum X[k] exp(2 pi i j k / n). Divide by n to invert fft_forward().
+*/
+void fft_inverse(const FftPlan* plan, double* re, double* im) {
+	fft_transform(plan, re, im, 1.);
+}
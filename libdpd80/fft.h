@@ -0,0 +1,16 @@
+#ifndef FFT_H
+#define FFT_H
+
+typedef struct fft_plan {
+	int n;
+	int* bitrev;
+	double* cos_table;
+	double* sin_table;
+} FftPlan;
+
+FftPlan* fft_create(int n);
+void fft_destroy(FftPlan* plan);
+void fft_forward(const FftPlan* plan, double* re, double* im);
+void fft_inverse(const FftPlan* plan, double* re, double* im);
+
+#endif
@@ -0,0 +1,283 @@
+/*
+	Software triggering on the port S and T bits carried in the top two bits of every sample.
+	Edge modes emit a segment of pre + post samples around every edge, level modes emit the
+	start, length and sum of every gate interval. The stream is never re-armed, so there is no
+	dead time between events. Edges are searched with SSE2, so chunks without events cost one pass.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <emmintrin.h>
+#include "ri.h"
+#include "callbacks.h"
+#include "kernels.h"
+#include "gate.h"
+
+#define GATE_MAX_ACTIVE 256	// segments that may be waiting for post-trigger samples at once
+
+typedef struct gate_segment {
+	int64_t index;		// absolute sample index of the trigger
+	int filled;
+	uint16_t* samples;
+} GateSegment;
+
+typedef struct gate_state {
+	int64_t samples_left;
+	int unlimited;
+	int64_t stream_index;		// absolute index of data[0]
+
+	uint16_t port_mask;
+	int edge_mode;
+	int active_level;			// port state that triggers / opens the gate
+	int last_level;				// port state of the previous sample, -1 before the first chunk
+
+	// edge modes
+	int pre;
+	int post;
+	uint16_t* window;			// last pre samples followed by the current chunk
+	int window_size;
+	int history;				// valid samples in front of the current chunk
+	GateSegment active[GATE_MAX_ACTIVE];
+	int n_active;
+
+	// level modes
+	int64_t gate_start;
+	unsigned long long gate_sum;
+
+	unsigned long long events;
+	unsigned long long events_skipped;
+	unsigned long long dataloss_events;
+} GateState;
+
+/*
+	Return the index of the first sample from i on whose port bit differs from the sample before it, n if none.
+*/
+static int find_edge(const uint16_t* data, int i, int n, uint16_t port_mask, int last_level) {
+	const __m128i mask = _mm_set1_epi16(port_mask);
+
+	if (i == 0) {
+		if (n > 0 && ((data[0] & port_mask) != 0) != last_level)
+			return 0;
+		i = 1;
+	}
+	for (; i + 16 <= n; i += 16) {
+		__m128i a0 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), mask);
+		__m128i b0 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i - 1)), mask);
+		__m128i a1 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i + 8)), mask);
+		__m128i b1 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i + 7)), mask);
+		__m128i eq = _mm_and_si128(_mm_cmpeq_epi16(a0, b0), _mm_cmpeq_epi16(a1, b1));
+		if (_mm_movemask_epi8(eq) != 0xffff)
+			break;
+	}
+	for (; i < n; ++i) {
+		if ((data[i] & port_mask) != (data[i - 1] & port_mask))
+			return i;
+	}
+	return n;
+}
+
+static void emit_segment(const GateSegment* segment, int length) {
+	printf("DATA: %lld", segment->index);
+	for (int k = 0; k < length; ++k) {
+		printf(";%d", segment->samples[k] & SAMPLE_DATA_MASK);
+	}
+	printf("\n");
+}
+
+/*
+	Copy up to n post-trigger samples into the segment and emit it once it is complete.
+	Returns whether the segment is still waiting for samples.
+*/
+static int fill_segment(GateState* state, GateSegment* segment, const uint16_t* data, int n) {
+	const int length = state->pre + state->post;
+	if (n > length - segment->filled)
+		n = length - segment->filled;
+	memcpy(segment->samples + segment->filled, data, n * sizeof(uint16_t));
+	segment->filled += n;
+
+	if (segment->filled < length)
+		return 1;
+	emit_segment(segment, length);
+	free(segment->samples);
+	return 0;
+}
+
+static void start_segment(GateState* state, const uint16_t* window, int i) {
+	if (i + state->history < state->pre || state->n_active == GATE_MAX_ACTIVE) {
+		state->events_skipped++;
+		return;
+	}
+
+	GateSegment* segment = &state->active[state->n_active];
+	segment->samples = malloc((state->pre + state->post) * sizeof(uint16_t));
+	if (segment->samples == NULL) {
+		state->events_skipped++;
+		return;
+	}
+	segment->index = state->stream_index + i;
+	segment->filled = state->pre;
+	memcpy(segment->samples, window + state->history + i - state->pre, state->pre * sizeof(uint16_t));
+	state->n_active++;
+	state->events++;
+}
+
+static int gate_edges(GateState* state, const uint16_t* data, int ndata) {
+	// window = [last pre samples | chunk], so pre-trigger samples are always contiguous
+	if (state->history + ndata > state->window_size) {
+		uint16_t* window = realloc(state->window, 2 * (state->pre + ndata) * sizeof(uint16_t));
+		if (window == NULL) {
+			printf("ERR!: OUT OF MEMORY\n");
+			return 0;
+		}
+		state->window = window;
+		state->window_size = 2 * (state->pre + ndata);
+	}
+	uint16_t* window = state->window;
+	memcpy(window + state->history, data, ndata * sizeof(uint16_t));
+
+	// segments triggered in earlier chunks continue at data[0] and complete first
+	int kept = 0;
+	for (int k = 0; k < state->n_active; ++k) {
+		if (fill_segment(state, &state->active[k], data, ndata))
+			state->active[kept++] = state->active[k];
+	}
+	state->n_active = kept;
+
+	const int first_new = state->n_active;
+	for (int i = find_edge(data, 0, ndata, state->port_mask, state->last_level); i < ndata;
+		i = find_edge(data, i + 1, ndata, state->port_mask, state->last_level)) {
+		state->last_level = (data[i] & state->port_mask) != 0;
+		if (state->last_level == state->active_level)
+			start_segment(state, window, i);
+	}
+
+	// post-trigger samples of the new segments that are already in this chunk
+	kept = first_new;
+	for (int k = first_new; k < state->n_active; ++k) {
+		GateSegment* segment = &state->active[k];
+		int i = (int)(segment->index - state->stream_index);
+		if (fill_segment(state, segment, data + i, ndata - i))
+			state->active[kept++] = *segment;
+	}
+	state->n_active = kept;
+
+	// keep the last pre samples in front of the next chunk
+	const int total = state->history + ndata;
+	const int history = total < state->pre ? total : state->pre;
+	memmove(window, window + total - history, history * sizeof(uint16_t));
+	state->history = history;
+	return 1;
+}
+
+static void gate_levels(GateState* state, const uint16_t* data, int ndata) {
+	int i = 0, from = 0;
+	for (;;) {
+		// data[i..j) is at a constant port level
+		int j = find_edge(data, from, ndata, state->port_mask, state->last_level);
+		if (state->last_level == state->active_level)
+			state->gate_sum += kernel_sum(data + i, j - i);
+		if (j == ndata)
+			break;
+
+		state->last_level = (data[j] & state->port_mask) != 0;
+		if (state->last_level == state->active_level) {
+			state->gate_start = state->stream_index + j;
+			state->gate_sum = 0;
+		}
+		else if (state->gate_start >= 0) {
+			printf("DATA: %lld;%lld;%llu\n", state->gate_start, state->stream_index + j - state->gate_start, state->gate_sum);
+			state->events++;
+		}
+		i = j;
+		from = j + 1;
+	}
+}
+
+/*
+	Scan the port bits of the chunk and emit segments or gate sums of all events.
+*/
+int callback_gate(uint16_t* data, int ndata, int dataloss, void* userdata)
+{
+	GateState* state = (GateState*)userdata;
+
+	if (dataloss) {
+		printf("ERR!: DATA LOSS DETECTED\n");
+		state->dataloss_events++;
+	}
+
+	// the port level before the first sample is taken from the first sample, so the stream start
+	// is no edge and a gate that is already open is not reported
+	if (state->last_level < 0 && ndata > 0)
+		state->last_level = (data[0] & state->port_mask) != 0;
+
+	if (state->edge_mode) {
+		if (!gate_edges(state, data, ndata))
+			return 0;
+	}
+	else {
+		gate_levels(state, data, ndata);
+	}
+
+	state->stream_index += ndata;
+	return samples_remaining(&state->samples_left, ndata, state->unlimited);
+}
+
+/*
+	Run the gated acquisition with the trigger mode given in config.
+*/
+ERROR_STATUS run_gate(ri_device* device, const Config* config) {
+	GateState* state = calloc(1, sizeof(GateState));
+	if (state == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		return STATUS_FAILURE;
+	}
+	state->samples_left = config->n_samples;
+	state->unlimited = config->n_samples == 0;
+	state->pre = (int)config->pre_trigger;
+	state->post = (int)config->post_trigger;
+	state->gate_start = -1;
+
+	switch (config->trigger_mode) {
+	case RI_TRIG_S_RISING:	state->port_mask = SAMPLE_PORT_S; state->edge_mode = 1; state->active_level = 1; break;
+	case RI_TRIG_S_FALLING:	state->port_mask = SAMPLE_PORT_S; state->edge_mode = 1; state->active_level = 0; break;
+	case RI_TRIG_S_HIGH:	state->port_mask = SAMPLE_PORT_S; state->edge_mode = 0; state->active_level = 1; break;
+	case RI_TRIG_S_LOW:		state->port_mask = SAMPLE_PORT_S; state->edge_mode = 0; state->active_level = 0; break;
+	case RI_TRIG_T_RISING:	state->port_mask = SAMPLE_PORT_T; state->edge_mode = 1; state->active_level = 1; break;
+	case RI_TRIG_T_FALLING:	state->port_mask = SAMPLE_PORT_T; state->edge_mode = 1; state->active_level = 0; break;
+	case RI_TRIG_T_HIGH:	state->port_mask = SAMPLE_PORT_T; state->edge_mode = 0; state->active_level = 1; break;
+	case RI_TRIG_T_LOW:		state->port_mask = SAMPLE_PORT_T; state->edge_mode = 0; state->active_level = 0; break;
+	default:
+		printf("ERR!: TRIGGER MODE UNKNOWN\n");
+		free(state);
+		return STATUS_FAILURE;
+	}
+	state->last_level = -1;
+
+	install_stop_handler();
+
+	printf("META: REQUEST GATE SAMPLES %llu\n", config->n_samples);
+	if (state->edge_mode)
+		printf("META: SEGMENT PRE %d POST %d\n", state->pre, state->post);
+	printf("META: START_OF_STREAM\n");
+	double initial_time = (double)clock() / CLOCKS_PER_SEC;
+	int err = ri_start_continuous_transfer(device, callback_gate, state);
+	double final_time = (double)clock() / CLOCKS_PER_SEC;
+	printf("META: END_OF_STREAM\n");
+
+	remove_stop_handler();
+
+	print_transfer_summary(state->stream_index, final_time - initial_time);
+	printf("META: EVENTS %llu\n", state->events);
+	printf("META: EVENTS SKIPPED %llu\n", state->events_skipped);
+	printf("META: INCOMPLETE SEGMENTS %d\n", state->n_active);
+	printf("META: DATA LOSS EVENTS %llu\n", state->dataloss_events);
+
+	for (int k = 0; k < state->n_active; ++k) {
+		free(state->active[k].samples);
+	}
+	free(state->window);
+	free(state);
+	return err == 0 ? STATUS_SUCCESS : STATUS_FAILURE;
+}
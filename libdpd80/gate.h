@@ -0,0 +1,11 @@
+#ifndef GATE_H
+#define GATE_H
+
+#include "ri.h"
+#include "config.h"
+#include "libdpd80.h"
+
+ERROR_STATUS run_gate(ri_device* device, const Config* config);
+int callback_gate(uint16_t* data, int ndata, int dataloss, void* userdata);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+	Measurement kernels shared by the live callbacks and the offline analyzer.
+	Every kernel accumulates into a result that can be merged with the result of another part of the stream,
+	so a recording can be split into slices that are processed in parallel.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <emmintrin.h>
+#include "kernels.h"
+
+#define STATS_BLOCK (1 << 24)	// samples summed exactly in integers before merging
+
+#define KERNELS_PI 3.14159265358979323846
+
+static unsigned long long hsum64(__m128i v) {
+	unsigned long long lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, v);
+	return lanes[0] + lanes[1];
+}
+
+static __m128i widen_add(__m128i acc, __m128i v) {
+	const __m128i zero = _mm_setzero_si128();
+	acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+	return _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+}
+
+/*
+	Sum of the samples under the counter bit mask, the value printed by callback_counter.
+*/
+unsigned long long kernel_counter_sum(const uint16_t* data, int64_t n) {
+	const __m128i mask = _mm_set1_epi16(COUNTER_MASK);
+	const __m128i ones = _mm_set1_epi16(1);
+	__m128i acc = _mm_setzero_si128();
+	unsigned long long sum = 0;
+	int64_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), mask);
+		__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i + 8)), mask);
+		acc = widen_add(acc, _mm_madd_epi16(_mm_add_epi16(a, b), ones));
+	}
+	for (; i < n; ++i) {
+		sum += data[i] & COUNTER_MASK;
+	}
+	return sum + hsum64(acc);
+}
+
+/*
+	Sum of the ADC codes.
+*/
+unsigned long long kernel_sum(const uint16_t* data, int64_t n) {
+	const __m128i mask = _mm_set1_epi16(SAMPLE_DATA_MASK);
+	const __m128i ones = _mm_set1_epi16(1);
+	__m128i acc = _mm_setzero_si128();
+	unsigned long long sum = 0;
+	int64_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), mask);
+		acc = widen_add(acc, _mm_madd_epi16(v, ones));
+	}
+	for (; i < n; ++i) {
+		sum += data[i] & SAMPLE_DATA_MASK;
+	}
+	return sum + hsum64(acc);
+}
+
+/*
+	Histogram of the ADC codes. Consecutive samples go to different lanes, so runs of equal
+	codes do not serialize on a single counter.
+*/
+void kernel_histogram(const uint16_t* data, int64_t n, Histogram* histogram) {
+	int64_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		histogram->bins[0][data[i] & SAMPLE_DATA_MASK]++;
+		histogram->bins[1][data[i + 1] & SAMPLE_DATA_MASK]++;
+		histogram->bins[2][data[i + 2] & SAMPLE_DATA_MASK]++;
+		histogram->bins[3][data[i + 3] & SAMPLE_DATA_MASK]++;
+	}
+	for (; i < n; ++i) {
+		histogram->bins[0][data[i] & SAMPLE_DATA_MASK]++;
+	}
+}
+
+unsigned long long histogram_bin(const Histogram* histogram, int code) {
+	unsigned long long count = 0;
+	for (int lane = 0; lane < HISTOGRAM_LANES; ++lane) {
+		count += histogram->bins[lane][code];
+	}
+	return count;
+}
+
+void histogram_merge(Histogram* a, const Histogram* b) {
+	for (int lane = 0; lane < HISTOGRAM_LANES; ++lane) {
+		for (int code = 0; code < HISTOGRAM_BINS; ++code) {
+			a->bins[lane][code] += b->bins[lane][code];
+		}
+	}
+}
+
+void stats_init(SampleStats* stats) {
+	stats->n = 0;
+	stats->mean = 0.;
+	stats->m2 = 0.;
+	stats->min = SAMPLE_DATA_MASK;
+	stats->max = 0;
+}
+
+/*
+	Merge the moments of b into a (Chan et al. pairwise update).
+*/
+void stats_merge(SampleStats* a, const SampleStats* b) {
+	if (b->n == 0)
+		return;
+	if (a->n == 0) {
+		*a = *b;
+		return;
+	}
+
+	const double n = (double)(a->n + b->n);
+	const double delta = b->mean - a->mean;
+	a->mean += delta * b->n / n;
+	a->m2 += b->m2 + delta * delta * a->n * (double)b->n / n;
+	a->n += b->n;
+	if (b->min < a->min)
+		a->min = b->min;
+	if (b->max > a->max)
+		a->max = b->max;
+}
+
+/*
+	Count, mean, variance, minimum and maximum of the ADC codes.
+*/
+void kernel_stats(const uint16_t* data, int64_t n, SampleStats* stats) {
+	const __m128i mask = _mm_set1_epi16(SAMPLE_DATA_MASK);
+	const __m128i ones = _mm_set1_epi16(1);
+
+	for (int64_t start = 0; start < n; start += STATS_BLOCK) {
+		const int64_t end = n - start < STATS_BLOCK ? n : start + STATS_BLOCK;
+		__m128i acc_sum = _mm_setzero_si128();
+		__m128i acc_sq = _mm_setzero_si128();
+		__m128i vmin = _mm_set1_epi16(SAMPLE_DATA_MASK);
+		__m128i vmax = _mm_setzero_si128();
+		unsigned long long sum = 0, sq = 0;
+		int64_t i = start;
+
+		for (; i + 8 <= end; i += 8) {
+			__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), mask);
+			acc_sum = widen_add(acc_sum, _mm_madd_epi16(v, ones));
+			acc_sq = widen_add(acc_sq, _mm_madd_epi16(v, v));
+			vmin = _mm_min_epi16(vmin, v);
+			vmax = _mm_max_epi16(vmax, v);
+		}
+
+		int16_t lanes_min[8], lanes_max[8];
+		_mm_storeu_si128((__m128i*)lanes_min, vmin);
+		_mm_storeu_si128((__m128i*)lanes_max, vmax);
+		SampleStats block;
+		stats_init(&block);
+		for (int k = 0; k < 8; ++k) {
+			if (lanes_min[k] < block.min)
+				block.min = lanes_min[k];
+			if (lanes_max[k] > block.max)
+				block.max = lanes_max[k];
+		}
+		for (; i < end; ++i) {
+			const int x = data[i] & SAMPLE_DATA_MASK;
+			sum += x;
+			sq += (unsigned long long)x * x;
+			if (x < block.min)
+				block.min = x;
+			if (x > block.max)
+				block.max = x;
+		}
+		sum += hsum64(acc_sum);
+		sq += hsum64(acc_sq);
+
+		block.n = end - start;
+		block.mean = (double)sum / block.n;
+		block.m2 = (double)sq - (double)sum * block.mean;
+		stats_merge(stats, &block);
+	}
+}
+
+/*
+	Welch power spectral density with a Hann window and non-overlapping segments of nfft samples.
+*/
+Psd* psd_create(int nfft) {
+	Psd* psd = calloc(1, sizeof(Psd));
+	if (psd == NULL)
+		return NULL;
+	psd->nfft = nfft;
+	psd->plan = fft_create(nfft);
+	psd->window = malloc(nfft * sizeof(double));
+	psd->re = malloc(nfft * sizeof(double));
+	psd->im = malloc(nfft * sizeof(double));
+	psd->power = calloc(nfft / 2 + 1, sizeof(double));
+	if (psd->plan == NULL || psd->window == NULL || psd->re == NULL || psd->im == NULL || psd->power == NULL) {
+		psd_destroy(psd);
+		return NULL;
+	}
+
+	for (int k = 0; k < nfft; ++k) {
+		psd->window[k] = 0.5 - 0.5 * cos(2. * KERNELS_PI * k / nfft);
+		psd->window_power += psd->window[k] * psd->window[k];
+	}
+	return psd;
+}
+
+void psd_destroy(Psd* psd) {
+	if (psd == NULL)
+		return;
+	fft_destroy(psd->plan);
+	free(psd->window);
+	free(psd->re);
+	free(psd->im);
+	free(psd->power);
+	free(psd);
+}
+
+/*
+	Accumulate the segments of data, only whole segments are used.
+	Two segments share one complex transform, the first as real and the second as imaginary part.
+*/
+void kernel_psd(const uint16_t* data, int64_t n, Psd* psd) {
+	const int nfft = psd->nfft;
+	const int64_t segments = n / nfft;
+
+	for (int64_t s = 0; s < segments; s += 2) {
+		const uint16_t* a = data + s * nfft;
+		const uint16_t* b = s + 1 < segments ? a + nfft : NULL;
+		for (int k = 0; k < nfft; ++k) {
+			psd->re[k] = psd->window[k] * (a[k] & SAMPLE_DATA_MASK);
+			psd->im[k] = b ? psd->window[k] * (b[k] & SAMPLE_DATA_MASK) : 0.;
+		}
+		fft_forward(psd->plan, psd->re, psd->im);
+
+		// A[k] = (Z[k] + conj(Z[-k])) / 2, B[k] = (Z[k] - conj(Z[-k])) / 2i
+		for (int k = 0; k <= nfft / 2; ++k) {
+			const int m = (nfft - k) & (nfft - 1);
+			const double ar = 0.5 * (psd->re[k] + psd->re[m]);
+			const double ai = 0.5 * (psd->im[k] - psd->im[m]);
+			const double br = 0.5 * (psd->im[k] + psd->im[m]);
+			const double bi = -0.5 * (psd->re[k] - psd->re[m]);
+			psd->power[k] += ar * ar + ai * ai + br * br + bi * bi;
+		}
+		psd->n_segments += b ? 2 : 1;
+	}
+}
+
+void psd_merge(Psd* a, const Psd* b) {
+	for (int k = 0; k <= a->nfft / 2; ++k) {
+		a->power[k] += b->power[k];
+	}
+	a->n_segments += b->n_segments;
+}
+
+/*
+	One-sided power spectral density of bin k in codes^2 / Hz.
+*/
+double psd_density(const Psd* psd, int k, double sample_rate) {
+	if (psd->n_segments == 0)
+		return 0.;
+	double density = psd->power[k] / (psd->n_segments * sample_rate * psd->window_power);
+	if (k != 0 && k != psd->nfft / 2)
+		density *= 2.;
+	return density;
+}
@@ -0,0 +1,52 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdint.h>
+#include "fft.h"
+#include "libdpd80.h"
+
+#define COUNTER_MASK 0x03ff
+#define HISTOGRAM_BINS (SAMPLE_DATA_MASK + 1)
+#define HISTOGRAM_LANES 4
+
+typedef struct histogram {
+	unsigned long long bins[HISTOGRAM_LANES][HISTOGRAM_BINS];
+} Histogram;
+
+typedef struct sample_stats {
+	unsigned long long n;
+	double mean;
+	double m2;		// sum of squared deviations from the mean
+	int min;
+	int max;
+} SampleStats;
+
+typedef struct psd {
+	int nfft;
+	FftPlan* plan;
+	double* window;
+	double window_power;	// sum of the squared window
+	double* re;
+	double* im;
+	double* power;			// nfft / 2 + 1 accumulated one-sided bins
+	unsigned long long n_segments;
+} Psd;
+
+unsigned long long kernel_counter_sum(const uint16_t* data, int64_t n);
+unsigned long long kernel_sum(const uint16_t* data, int64_t n);
+
+void kernel_histogram(const uint16_t* data, int64_t n, Histogram* histogram);
+unsigned long long histogram_bin(const Histogram* histogram, int code);
+void histogram_merge(Histogram* a, const Histogram* b);
+
+void stats_init(SampleStats* stats);
+void kernel_stats(const uint16_t* data, int64_t n, SampleStats* stats);
+void stats_merge(SampleStats* a, const SampleStats* b);
+
+Psd* psd_create(int nfft);
+void psd_destroy(Psd* psd);
+void kernel_psd(const uint16_t* data, int64_t n, Psd* psd);
+void psd_merge(Psd* a, const Psd* b);
+double psd_density(const Psd* psd, int k, double sample_rate);
+
+#endif
@@ -1,11 +1,24 @@
 #define DEBUG
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include "ri.h"
 #include "libdpd80.h"
 #include "callbacks.h"
 #include "config.h"
+#include "selftest.h"
+#include "allan.h"
+#include "gate.h"
+#include "kernels.h"
+#include "analyzer.h"
+#include "preview.h"
+#include "lockin.h"
+#include "events.h"
+#include "feedback.h"
+#include "correlation.h"
+#include "recorder.h"
+#include "burst.h"
 
 ERROR_STATUS main(int argc, char* argv[]) {
 #ifdef DEBUG
@@ -25,6 +38,14 @@ ERROR_STATUS main(int argc, char* argv[]) {
 	printf("META: CONFIG MEASUREMENT TYPE %d\n", config.measurement_type);
 #endif
 
+	// offline analysis and seeking in recordings run without a device
+	if (config.measurement_type == ANALYZE) {
+		return run_analyzer(&config);
+	}
+	if (config.measurement_type == LOCATE) {
+		return run_locate(&config);
+	}
+
 	// initialize device
 	ri_init();
 
@@ -38,30 +59,84 @@ ERROR_STATUS main(int argc, char* argv[]) {
 	}
 
 	// run measurement
+	ERROR_STATUS status = STATUS_SUCCESS;
 	if (config.measurement_type == COUNTER) {
-		const int64_t samples_to_transfer = config.n_samples;
+		CounterUserdata userdata = { config.n_samples, config.n_samples == 0 };
+		install_stop_handler();
 		double initial_time = (double)clock() / CLOCKS_PER_SEC;
 
-		int64_t samples_left = samples_to_transfer;
-
-		printf("META: REQUEST COUNTER SAMPLES %lld\n", samples_to_transfer);
+		printf("META: REQUEST COUNTER SAMPLES %llu\n", config.n_samples);
 		printf("META: START_OF_STREAM\n");
-		ri_start_continuous_transfer(device, callback_counter, &samples_left);
+		ri_start_continuous_transfer(device, callback_counter, &userdata);
 		printf("META: END_OF_STREAM\n");
 
 		double final_time = (double)clock() / CLOCKS_PER_SEC;
-		double MBs_transferred = samples_to_transfer * 2. / 1000000.;
-		printf("META: TRANSFERED / MB %.1f\n", MBs_transferred);
-		printf("META: ELAPSED TIME / s %g\n", final_time - initial_time);
-		printf("META: SPEED / MBPS %.2f\n", MBs_transferred / (final_time - initial_time));
+		remove_stop_handler();
+		print_transfer_summary(config.n_samples - userdata.samples_left, final_time - initial_time);
+	}
+	else if (config.measurement_type == HISTOGRAM) {
+		HistogramUserdata userdata = { config.n_samples, config.n_samples == 0, calloc(1, sizeof(Histogram)) };
+		if (userdata.histogram == NULL) {
+			printf("ERR!: OUT OF MEMORY\n");
+			status = STATUS_FAILURE;
+		}
+		else {
+			install_stop_handler();
+			double initial_time = (double)clock() / CLOCKS_PER_SEC;
+
+			printf("META: REQUEST HISTOGRAM SAMPLES %llu\n", config.n_samples);
+			printf("META: START_OF_STREAM\n");
+			ri_start_continuous_transfer(device, callback_histogram, &userdata);
+			remove_stop_handler();
+			for (int code = 0; code < HISTOGRAM_BINS; ++code) {
+				const unsigned long long count = histogram_bin(userdata.histogram, code);
+				if (count > 0)
+					printf("DATA: %d;%llu\n", code, count);
+			}
+			printf("META: END_OF_STREAM\n");
+
+			double final_time = (double)clock() / CLOCKS_PER_SEC;
+			print_transfer_summary(config.n_samples - userdata.samples_left, final_time - initial_time);
+			free(userdata.histogram);
+		}
+	}
+	else if (config.measurement_type == SELFTEST) {
+		status = run_selftest(device, &config);
+	}
+	else if (config.measurement_type == ALLAN) {
+		status = run_allan(device, &config);
+	}
+	else if (config.measurement_type == GATE) {
+		status = run_gate(device, &config);
+	}
+	else if (config.measurement_type == PREVIEW) {
+		status = run_preview(device, &config);
+	}
+	else if (config.measurement_type == LOCKIN) {
+		status = run_lockin(device, &config);
+	}
+	else if (config.measurement_type == EVENTS) {
+		status = run_events(device, &config);
+	}
+	else if (config.measurement_type == FEEDBACK) {
+		status = run_feedback(device, &config);
+	}
+	else if (config.measurement_type == CORRELATION) {
+		status = run_correlation(device, &config);
+	}
+	else if (config.measurement_type == RECORD) {
+		status = run_recorder(device, &config);
+	}
+	else if (config.measurement_type == BURST) {
+		status = run_burst(device, &config);
 	}
 	else {
 		printf("ERR!: MEASUREMENT TYPE UNKNOWN");
-		return 1;
+		status = STATUS_FAILURE;
 	}
 
 	// close device
 	device = ri_close_device(device);
 	ri_exit();
-	return 0;
+	return status;
 }
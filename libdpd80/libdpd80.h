@@ -6,6 +6,13 @@ typedef enum error_status {
 	STATUS_FAILURE = 1, 
 } ERROR_STATUS;
 
+// sample layout: bits 0-13 carry the ADC code, bits 14 and 15 the state of ports T and S
+#define SAMPLE_DATA_MASK 0x3fff
+#define SAMPLE_PORT_T 0x4000
+#define SAMPLE_PORT_S 0x8000
+
+#define SAMPLE_RATE 80000000	// ADC samples per second
+
 ERROR_STATUS main(int argc, char* argv[]);
 
 #endif
@@ -0,0 +1,269 @@
+/*
+	Multi-frequency digital lock-in.
+	The stream is cut into blocks of LOCKIN_BLOCK samples. For every reference the block is correlated with a fixed
+	cos / sin table of the block length, and the result is rotated by the reference phase at the block start,
+	sum x[k] exp(-i (phi0 + k dphi)) = exp(-i phi0) sum x[k] exp(-i k dphi).
+	The phase is a 64 bit accumulator, so every reference stays phase continuous across blocks and chunks.
+	Each block is converted once and stays in cache while all references are correlated, so tracking many
+	frequencies costs one pass over memory.
+	The baseline is subtracted before mixing, so it does not leak into the references. It is the running mean over
+	the filter window that ended with the previous output, so it stays unbiased by tones that are not integer cycles
+	per window. The block sums are summed over LOCKIN_CIC_PHASES sub-periods per output period and combined into a
+	CIC filter of order LOCKIN_CIC_ORDER, i.e. LOCKIN_CIC_ORDER boxcars of one output period each. Its zeros of that
+	order at every multiple of the output rate suppress the 2f image and everything that aliases onto the output.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <xmmintrin.h>
+#include "ri.h"
+#include "callbacks.h"
+#include "lockin.h"
+
+#define LOCKIN_BLOCK 256
+#define LOCKIN_PI 3.14159265358979323846
+#define LOCKIN_TWO_POW_64 18446744073709551616.
+#define LOCKIN_CIC_ORDER 3
+#define LOCKIN_CIC_PHASES 8			// sub-periods per output period
+#define LOCKIN_CIC_TAPS (LOCKIN_CIC_ORDER * (LOCKIN_CIC_PHASES - 1) + 1)
+
+typedef struct lockin_reference {
+	double frequency;
+	uint64_t phase;				// phase at the start of the next block, 2^64 is one period
+	uint64_t phase_step;		// phase advance per sample
+	float cos_table[LOCKIN_BLOCK];
+	float sin_table[LOCKIN_BLOCK];
+	double sub_i;				// sum over the current sub-period
+	double sub_q;
+	double history_i[LOCKIN_CIC_TAPS];	// sub-period sums, ring indexed by the sub-period count
+	double history_q[LOCKIN_CIC_TAPS];
+} LockinReference;
+
+typedef struct lockin_state {
+	int64_t samples_left;
+	int unlimited;
+	int64_t samples_seen;
+	int polar;
+
+	float block[LOCKIN_BLOCK];
+	int n_block;
+	int64_t blocks_per_sub;
+	int64_t blocks;
+	int64_t subs;
+	double weights[LOCKIN_CIC_TAPS];
+
+	double offset;				// baseline subtracted before mixing
+	double sub_sum;				// raw sum over the current sub-period
+	double total_sum;
+	double history_mean[LOCKIN_CIC_TAPS];	// sub-period means, ring like the reference sums
+
+	LockinReference references[MAX_LOCKIN_FREQUENCIES];
+	int n_references;
+	unsigned long long dataloss_events;
+} LockinState;
+
+static void lockin_init_reference(LockinReference* reference, double frequency) {
+	memset(reference, 0, sizeof(LockinReference));
+	reference->frequency = frequency;
+	// frequency is below Nyquist, so the step stays below 2^63
+	reference->phase_step = (uint64_t)(frequency / SAMPLE_RATE * LOCKIN_TWO_POW_64);
+	for (int k = 0; k < LOCKIN_BLOCK; ++k) {
+		const double angle = 2. * LOCKIN_PI * (double)(reference->phase_step * (uint64_t)k) / LOCKIN_TWO_POW_64;
+		reference->cos_table[k] = (float)cos(angle);
+		reference->sin_table[k] = (float)sin(angle);
+	}
+}
+
+/*
+	Remove the offset, correlate the block with every reference and run the decimating filter.
+*/
+static void lockin_process_block(LockinState* state) {
+	const double scale = 2. / LOCKIN_BLOCK;
+
+	__m128 acc = _mm_setzero_ps();
+	for (int k = 0; k < LOCKIN_BLOCK; k += 4) {
+		acc = _mm_add_ps(acc, _mm_loadu_ps(state->block + k));
+	}
+	float lanes[4];
+	_mm_storeu_ps(lanes, acc);
+	const double sum = (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	state->sub_sum += sum;
+	state->total_sum += sum;
+	if (state->blocks == 0)
+		state->offset = sum / LOCKIN_BLOCK;
+	const __m128 offset = _mm_set1_ps((float)state->offset);
+	for (int k = 0; k < LOCKIN_BLOCK; k += 4) {
+		_mm_storeu_ps(state->block + k, _mm_sub_ps(_mm_loadu_ps(state->block + k), offset));
+	}
+
+	for (int r = 0; r < state->n_references; ++r) {
+		LockinReference* reference = &state->references[r];
+		__m128 acc_c = _mm_setzero_ps();
+		__m128 acc_s = _mm_setzero_ps();
+		for (int k = 0; k < LOCKIN_BLOCK; k += 4) {
+			const __m128 x = _mm_loadu_ps(state->block + k);
+			acc_c = _mm_add_ps(acc_c, _mm_mul_ps(x, _mm_loadu_ps(reference->cos_table + k)));
+			acc_s = _mm_add_ps(acc_s, _mm_mul_ps(x, _mm_loadu_ps(reference->sin_table + k)));
+		}
+		float lanes_c[4], lanes_s[4];
+		_mm_storeu_ps(lanes_c, acc_c);
+		_mm_storeu_ps(lanes_s, acc_s);
+		const double a = (double)lanes_c[0] + lanes_c[1] + lanes_c[2] + lanes_c[3];
+		const double b = (double)lanes_s[0] + lanes_s[1] + lanes_s[2] + lanes_s[3];
+
+		// exp(-i phi0) (a - i b)
+		const double phi0 = 2. * LOCKIN_PI * (double)reference->phase / LOCKIN_TWO_POW_64;
+		const double c0 = cos(phi0), s0 = sin(phi0);
+		reference->sub_i += scale * (c0 * a - s0 * b);
+		reference->sub_q -= scale * (s0 * a + c0 * b);
+		reference->phase += reference->phase_step * LOCKIN_BLOCK;
+	}
+
+	state->blocks++;
+	if (state->blocks % state->blocks_per_sub != 0)
+		return;
+
+	const int slot = (int)(state->subs % LOCKIN_CIC_TAPS);
+	for (int r = 0; r < state->n_references; ++r) {
+		LockinReference* reference = &state->references[r];
+		reference->history_i[slot] = reference->sub_i;
+		reference->history_q[slot] = reference->sub_q;
+		reference->sub_i = 0.;
+		reference->sub_q = 0.;
+	}
+	state->history_mean[slot] = state->sub_sum / ((double)state->blocks_per_sub * LOCKIN_BLOCK);
+	state->sub_sum = 0.;
+	state->subs++;
+	if (state->subs % LOCKIN_CIC_PHASES != 0)
+		return;
+
+	// the next interval uses the filtered mean, until the window is filled the mean of all samples so far
+	if (state->subs < LOCKIN_CIC_TAPS) {
+		state->offset = state->total_sum / ((double)state->blocks * LOCKIN_BLOCK);
+	}
+	else {
+		state->offset = 0.;
+		for (int k = 0; k < LOCKIN_CIC_TAPS; ++k) {
+			state->offset += state->weights[k] * state->blocks_per_sub
+				* state->history_mean[(state->subs - 1 - k) % LOCKIN_CIC_TAPS];
+		}
+	}
+
+	// wait until the filter window only covers intervals with a filtered offset
+	if (state->subs < 2 * LOCKIN_CIC_TAPS + LOCKIN_CIC_PHASES - 1)
+		return;
+	printf("DATA: %lld", state->blocks * LOCKIN_BLOCK);
+	for (int r = 0; r < state->n_references; ++r) {
+		const LockinReference* reference = &state->references[r];
+		double i = 0., q = 0.;
+		for (int k = 0; k < LOCKIN_CIC_TAPS; ++k) {
+			const int h = (int)((state->subs - 1 - k) % LOCKIN_CIC_TAPS);
+			i += state->weights[k] * reference->history_i[h];
+			q += state->weights[k] * reference->history_q[h];
+		}
+		if (state->polar)
+			printf(";%g;%g", hypot(i, q), atan2(q, i));
+		else
+			printf(";%g;%g", i, q);
+	}
+	printf("\n");
+}
+
+/*
+	Convert the chunk into blocks and demodulate every completed block.
+*/
+int callback_lockin(uint16_t* data, int ndata, int dataloss, void* userdata)
+{
+	LockinState* state = (LockinState*)userdata;
+	int i = 0;
+
+	if (dataloss) {
+		printf("ERR!: DATA LOSS DETECTED\n");
+		state->dataloss_events++;
+	}
+
+	while (i < ndata) {
+		int n = LOCKIN_BLOCK - state->n_block;
+		if (n > ndata - i)
+			n = ndata - i;
+		for (int k = 0; k < n; ++k) {
+			state->block[state->n_block + k] = (float)(data[i + k] & SAMPLE_DATA_MASK);
+		}
+		state->n_block += n;
+		i += n;
+		if (state->n_block == LOCKIN_BLOCK) {
+			lockin_process_block(state);
+			state->n_block = 0;
+		}
+	}
+
+	state->samples_seen += ndata;
+	return samples_remaining(&state->samples_left, ndata, state->unlimited);
+}
+
+/*
+	Run the lock-in on all reference frequencies of config.
+*/
+ERROR_STATUS run_lockin(ri_device* device, const Config* config) {
+	LockinState* state = calloc(1, sizeof(LockinState));
+	if (state == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		return STATUS_FAILURE;
+	}
+	state->samples_left = config->n_samples;
+	state->unlimited = config->n_samples == 0;
+	state->polar = config->lockin_polar;
+	state->n_references = config->n_lockin_frequencies;
+	for (int r = 0; r < state->n_references; ++r) {
+		lockin_init_reference(&state->references[r], config->lockin_frequencies[r]);
+	}
+
+	// output period is rounded to whole sub-periods of whole blocks
+	const double block_rate = (double)SAMPLE_RATE / LOCKIN_BLOCK;
+	state->blocks_per_sub = (int64_t)(block_rate / config->lockin_rate / LOCKIN_CIC_PHASES + 0.5);
+	if (state->blocks_per_sub < 1)
+		state->blocks_per_sub = 1;
+	const double output_rate = block_rate / (state->blocks_per_sub * LOCKIN_CIC_PHASES);
+
+	// LOCKIN_CIC_ORDER boxcars of LOCKIN_CIC_PHASES sub-periods, unit gain for the block averages
+	state->weights[0] = 1.;
+	for (int order = 0; order < LOCKIN_CIC_ORDER; ++order) {
+		const int length = order * (LOCKIN_CIC_PHASES - 1) + 1;
+		for (int k = length + LOCKIN_CIC_PHASES - 2; k >= 0; --k) {
+			double w = 0.;
+			for (int j = 0; j < LOCKIN_CIC_PHASES; ++j) {
+				if (k - j >= 0 && k - j < length)
+					w += state->weights[k - j];
+			}
+			state->weights[k] = w;
+		}
+	}
+	for (int k = 0; k < LOCKIN_CIC_TAPS; ++k) {
+		state->weights[k] /= pow(LOCKIN_CIC_PHASES, LOCKIN_CIC_ORDER) * state->blocks_per_sub;
+	}
+
+	install_stop_handler();
+
+	printf("META: REQUEST LOCKIN SAMPLES %llu\n", config->n_samples);
+	for (int r = 0; r < state->n_references; ++r) {
+		printf("META: REFERENCE %d / Hz %.6f\n", r, state->references[r].frequency);
+	}
+	printf("META: OUTPUT RATE / Hz %g\n", output_rate);
+	printf("META: OUTPUT FORMAT %s\n", state->polar ? "R;THETA" : "I;Q");
+	printf("META: START_OF_STREAM\n");
+	double initial_time = (double)clock() / CLOCKS_PER_SEC;
+	int err = ri_start_continuous_transfer(device, callback_lockin, state);
+	double final_time = (double)clock() / CLOCKS_PER_SEC;
+	printf("META: END_OF_STREAM\n");
+
+	remove_stop_handler();
+
+	print_transfer_summary(state->samples_seen, final_time - initial_time);
+	printf("META: DATA LOSS EVENTS %llu\n", state->dataloss_events);
+
+	free(state);
+	return err == 0 ? STATUS_SUCCESS : STATUS_FAILURE;
+}
@@ -0,0 +1,11 @@
+#ifndef LOCKIN_H
+#define LOCKIN_H
+
+#include "ri.h"
+#include "config.h"
+#include "libdpd80.h"
+
+ERROR_STATUS run_lockin(ri_device* device, const Config* config);
+int callback_lockin(uint16_t* data, int ndata, int dataloss, void* userdata);
+
+#endif
@@ -0,0 +1,291 @@
+/*
+	Live min / max / mean envelope of the full-rate stream.
+	Samples are reduced into buckets of 256 samples, and every further level combines 16 buckets of the level below.
+	Each level keeps a ring of its last PREVIEW_CAPACITY buckets, so any span from microseconds to hours can be drawn
+	from the level whose buckets are just finer than a display pixel, at a cost of at most 16 buckets per pixel.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <emmintrin.h>
+#include "ri.h"
+#include "callbacks.h"
+#include "preview.h"
+
+typedef struct preview_state {
+	int64_t samples_left;
+	int unlimited;
+	int64_t report_interval;
+	int64_t report_next;
+	int width;
+	int64_t window;
+	int level;					// -1 picks the level per frame
+	PreviewPixel* pixels;
+	preview_sink sink;
+	void* sink_userdata;
+	unsigned long long dataloss_events;
+	Preview preview;
+} PreviewState;
+
+static int level_shift(int k) {
+	return PREVIEW_BASE_SHIFT + k * PREVIEW_FACTOR_SHIFT;
+}
+
+static int64_t level_oldest(const PreviewLevel* level) {
+	return level->completed > PREVIEW_CAPACITY ? level->completed - PREVIEW_CAPACITY : 0;
+}
+
+static void bucket_clear(PreviewBucket* bucket) {
+	bucket->min = SAMPLE_DATA_MASK;
+	bucket->max = 0;
+	bucket->count = 0;
+	bucket->sum = 0;
+}
+
+static void bucket_merge(PreviewBucket* a, const PreviewBucket* b) {
+	if (b->count == 0)
+		return;
+	if (b->min < a->min)
+		a->min = b->min;
+	if (b->max > a->max)
+		a->max = b->max;
+	a->count += b->count;
+	a->sum += b->sum;
+}
+
+/*
+	Reduce data[0..n) into the bucket.
+*/
+static void bucket_reduce(PreviewBucket* bucket, const uint16_t* data, int n) {
+	const __m128i mask = _mm_set1_epi16(SAMPLE_DATA_MASK);
+	const __m128i ones = _mm_set1_epi16(1);
+	__m128i vmin = _mm_set1_epi16(SAMPLE_DATA_MASK);
+	__m128i vmax = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), mask);
+		vmin = _mm_min_epi16(vmin, v);
+		vmax = _mm_max_epi16(vmax, v);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(v, ones));
+	}
+
+	// at most 256 samples per level 0 bucket, the 32 bit lanes cannot overflow
+	uint16_t lanes_min[8], lanes_max[8];
+	uint32_t lanes_sum[4];
+	_mm_storeu_si128((__m128i*)lanes_min, vmin);
+	_mm_storeu_si128((__m128i*)lanes_max, vmax);
+	_mm_storeu_si128((__m128i*)lanes_sum, acc);
+	for (int k = 0; k < 8; ++k) {
+		if (lanes_min[k] < bucket->min)
+			bucket->min = lanes_min[k];
+		if (lanes_max[k] > bucket->max)
+			bucket->max = lanes_max[k];
+	}
+	bucket->sum += (unsigned long long)lanes_sum[0] + lanes_sum[1] + lanes_sum[2] + lanes_sum[3];
+	for (; i < n; ++i) {
+		const uint16_t x = data[i] & SAMPLE_DATA_MASK;
+		if (x < bucket->min)
+			bucket->min = x;
+		if (x > bucket->max)
+			bucket->max = x;
+		bucket->sum += x;
+	}
+	bucket->count += n;
+}
+
+void preview_init(Preview* preview) {
+	memset(preview, 0, sizeof(Preview));
+	for (int k = 0; k < PREVIEW_LEVELS; ++k) {
+		bucket_clear(&preview->levels[k].partial);
+	}
+}
+
+/*
+	Store the completed partial bucket of level k and carry it into the level above.
+*/
+static void level_complete(Preview* preview, int k) {
+	while (k < PREVIEW_LEVELS) {
+		PreviewLevel* level = &preview->levels[k];
+		const PreviewBucket bucket = level->partial;
+		level->buckets[level->completed % PREVIEW_CAPACITY] = bucket;
+		level->completed++;
+		bucket_clear(&level->partial);
+
+		if (k + 1 == PREVIEW_LEVELS)
+			return;
+		PreviewLevel* above = &preview->levels[k + 1];
+		bucket_merge(&above->partial, &bucket);
+		if (above->partial.count < (1u << level_shift(k + 1)))
+			return;
+		++k;
+	}
+}
+
+void preview_add(Preview* preview, const uint16_t* data, int ndata) {
+	const uint32_t size = 1u << PREVIEW_BASE_SHIFT;
+	PreviewLevel* level = &preview->levels[0];
+	int i = 0;
+
+	while (i < ndata) {
+		int n = (int)(size - level->partial.count);
+		if (n > ndata - i)
+			n = ndata - i;
+		bucket_reduce(&level->partial, data + i, n);
+		i += n;
+		if (level->partial.count == size)
+			level_complete(preview, 0);
+	}
+	preview->samples += ndata;
+}
+
+/*
+	Fill n_pixels pixels covering samples [first_sample, last_sample) from level k.
+	Pixels not covered by the buckets retained on that level have a NAN mean.
+*/
+void preview_query_level(const Preview* preview, int k, int64_t first_sample, int64_t last_sample, int n_pixels, PreviewPixel* pixels) {
+	const int64_t span = last_sample - first_sample;
+	const PreviewLevel* level = &preview->levels[k];
+	const int shift = level_shift(k);
+	const int64_t oldest = level_oldest(level);
+
+	for (int p = 0; p < n_pixels; ++p) {
+		const int64_t begin = first_sample + span * p / n_pixels;
+		const int64_t end = first_sample + span * (p + 1) / n_pixels;
+		int64_t b0 = begin >> shift;
+		int64_t b1 = ((end - 1) >> shift) + 1;
+		if (b0 < oldest)
+			b0 = oldest;
+		if (b1 > level->completed)
+			b1 = level->completed;
+
+		PreviewBucket pixel;
+		bucket_clear(&pixel);
+		for (int64_t b = b0; b < b1; ++b) {
+			bucket_merge(&pixel, &level->buckets[b % PREVIEW_CAPACITY]);
+		}
+		pixels[p].first_sample = begin;
+		pixels[p].min = pixel.min;
+		pixels[p].max = pixel.max;
+		pixels[p].mean = pixel.count ? (double)pixel.sum / pixel.count : NAN;
+	}
+}
+
+/*
+	Fill n_pixels pixels covering samples [first_sample, last_sample).
+	Uses the finest level that still retains first_sample and whose next level has buckets larger than a pixel,
+	so a pixel combines fewer than 32 buckets. Returns the level used.
+*/
+int preview_query(const Preview* preview, int64_t first_sample, int64_t last_sample, int n_pixels, PreviewPixel* pixels) {
+	const int64_t span = last_sample - first_sample;
+	int k = PREVIEW_LEVELS - 1;
+
+	for (int l = 0; l < PREVIEW_LEVELS; ++l) {
+		if ((first_sample >> level_shift(l)) < level_oldest(&preview->levels[l]))
+			continue;
+		k = l;
+		if (((int64_t)n_pixels << level_shift(l + 1)) > span)
+			break;
+	}
+
+	preview_query_level(preview, k, first_sample, last_sample, n_pixels, pixels);
+	return k;
+}
+
+/*
+	Default sink, prints one frame as first_sample;min;max;mean per pixel.
+*/
+static void print_frame(const PreviewPixel* pixels, int n_pixels, int level, void* userdata) {
+	(void)userdata;
+	printf("META: FRAME %lld %d LEVEL %d\n", n_pixels ? pixels[0].first_sample : 0, n_pixels, level);
+	for (int p = 0; p < n_pixels; ++p) {
+		if (isnan(pixels[p].mean))
+			continue;
+		printf("DATA: %lld;%d;%d;%.2f\n", pixels[p].first_sample, pixels[p].min, pixels[p].max, pixels[p].mean);
+	}
+}
+
+/*
+	Update the envelope pyramid and hand a frame of the last window samples to the sink every report interval.
+*/
+int callback_preview(uint16_t* data, int ndata, int dataloss, void* userdata)
+{
+	PreviewState* state = (PreviewState*)userdata;
+
+	if (dataloss) {
+		printf("ERR!: DATA LOSS DETECTED\n");
+		state->dataloss_events++;
+	}
+
+	preview_add(&state->preview, data, ndata);
+
+	if (state->preview.samples >= state->report_next) {
+		const int64_t last = state->preview.samples;
+		const int64_t first = last > state->window ? last - state->window : 0;
+		int level = state->level;
+		if (level < 0)
+			level = preview_query(&state->preview, first, last, state->width, state->pixels);
+		else
+			preview_query_level(&state->preview, level, first, last, state->width, state->pixels);
+		state->sink(state->pixels, state->width, level, state->sink_userdata);
+		state->report_next += state->report_interval;
+	}
+
+	return samples_remaining(&state->samples_left, ndata, state->unlimited);
+}
+
+/*
+	Run the live preview until n_samples are processed, or until Ctrl+C if n_samples is 0.
+	Every frame is handed to sink, which is called from the transfer callback and has to return quickly.
+	Frames are drawn from config->preview_level, or from the level matching the pixel size if it is -1.
+*/
+ERROR_STATUS run_preview_sink(ri_device* device, const Config* config, preview_sink sink, void* sink_userdata) {
+	PreviewState* state = calloc(1, sizeof(PreviewState));
+	PreviewPixel* pixels = malloc(config->preview_width * sizeof(PreviewPixel));
+	if (state == NULL || pixels == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		free(state);
+		free(pixels);
+		return STATUS_FAILURE;
+	}
+	preview_init(&state->preview);
+	state->samples_left = config->n_samples;
+	state->unlimited = config->n_samples == 0;
+	state->report_interval = config->report_interval;
+	state->report_next = config->report_interval;
+	state->width = (int)config->preview_width;
+	state->window = (int64_t)config->preview_window;
+	state->level = config->preview_level;
+	state->pixels = pixels;
+	state->sink = sink;
+	state->sink_userdata = sink_userdata;
+
+	install_stop_handler();
+
+	printf("META: REQUEST PREVIEW SAMPLES %llu\n", config->n_samples);
+	printf("META: START_OF_STREAM\n");
+	double initial_time = (double)clock() / CLOCKS_PER_SEC;
+	int err = ri_start_continuous_transfer(device, callback_preview, state);
+	double final_time = (double)clock() / CLOCKS_PER_SEC;
+	printf("META: END_OF_STREAM\n");
+
+	remove_stop_handler();
+
+	print_transfer_summary(state->preview.samples, final_time - initial_time);
+	printf("META: DATA LOSS EVENTS %llu\n", state->dataloss_events);
+
+	free(pixels);
+	free(state);
+	return err == 0 ? STATUS_SUCCESS : STATUS_FAILURE;
+}
+
+/*
+	Run the live preview with frames printed to stdout.
+*/
+ERROR_STATUS run_preview(ri_device* device, const Config* config) {
+	return run_preview_sink(device, config, print_frame, NULL);
+}
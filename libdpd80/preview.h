@@ -0,0 +1,49 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <stdint.h>
+#include "ri.h"
+#include "config.h"
+#include "libdpd80.h"
+
+#define PREVIEW_BASE_SHIFT 8		// level 0 buckets cover 256 samples
+#define PREVIEW_FACTOR_SHIFT 4		// every level combines 16 buckets of the level below
+#define PREVIEW_CAPACITY 4096		// buckets kept per level, the top level spans about 4 h
+
+typedef struct preview_bucket {
+	uint16_t min;
+	uint16_t max;
+	uint32_t count;
+	unsigned long long sum;
+} PreviewBucket;
+
+typedef struct preview_pixel {
+	int64_t first_sample;
+	int min;
+	int max;
+	double mean;	// NAN if the pixel is not covered by retained data
+} PreviewPixel;
+
+typedef void (*preview_sink)(const PreviewPixel* pixels, int n_pixels, int level, void* userdata);
+
+typedef struct preview_level {
+	PreviewBucket buckets[PREVIEW_CAPACITY];
+	int64_t completed;				// bucket i covers samples [i << shift, (i + 1) << shift)
+	PreviewBucket partial;
+} PreviewLevel;
+
+typedef struct preview {
+	PreviewLevel levels[PREVIEW_LEVELS];
+	int64_t samples;
+} Preview;
+
+void preview_init(Preview* preview);
+void preview_add(Preview* preview, const uint16_t* data, int ndata);
+int preview_query(const Preview* preview, int64_t first_sample, int64_t last_sample, int n_pixels, PreviewPixel* pixels);
+void preview_query_level(const Preview* preview, int k, int64_t first_sample, int64_t last_sample, int n_pixels, PreviewPixel* pixels);
+
+ERROR_STATUS run_preview(ri_device* device, const Config* config);
+ERROR_STATUS run_preview_sink(ri_device* device, const Config* config, preview_sink sink, void* sink_userdata);
+int callback_preview(uint16_t* data, int ndata, int dataloss, void* userdata);
+
+#endif
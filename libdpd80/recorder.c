@@ -0,0 +1,524 @@
+/*
+	Segmented raw recordings with an index for random access.
+	The recorder rotates into segment files of a fixed number of samples, so sample -> segment and byte offset is
+	plain arithmetic. The index adds one fixed size entry per RECORDING_STRIDE samples with the wall clock time of the
+	first sample of the stride, so a time is located by estimating the entry from the nominal sample rate and searching
+	from there if data loss or clock drift moved it. The index is only appended after the segment data of the
+	stride is flushed, so readers can seek in a recording that is still being written.
+	While recording, the transfer callback only copies into a pool of buffers; a writer thread does all file I/O, so
+	disk stalls up to the pool size do not stall the transfer.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <windows.h>
+#include "ri.h"
+#include "callbacks.h"
+#include "recorder.h"
+
+#define RECORDER_BUFFER (4 << 20)		// bytes of stdio buffer per segment file
+#define RECORDER_POOL 16				// buffers between the transfer callback and the writer
+#define RECORDER_POOL_SAMPLES (1 << 22)	// samples per pool buffer, the pool holds about 0.8 s
+
+typedef struct recorder_buffer {
+	uint16_t* data;
+	int n;
+	int dataloss;						// the buffer starts after a data loss, at most one per buffer
+	int64_t time_ns;					// wall clock when its last chunk arrived
+} RecorderBuffer;
+
+typedef struct recorder_state {
+	int64_t samples_left;
+	int unlimited;
+	Recorder* recorder;
+	int64_t report_interval;
+	uint64_t report_next;
+	uint64_t samples;					// samples received from the device
+
+	RecorderBuffer buffers[RECORDER_POOL];
+	int64_t produced;					// buffers handed to the writer
+	int64_t consumed;					// buffers written
+	int filling;						// the buffer produced % RECORDER_POOL holds samples not handed over yet
+	int pending_dataloss;
+	int overrun;						// chunks are dropped until a buffer is free
+	unsigned long long overrun_samples;
+	int done;
+	int failed;
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE changed;
+} RecorderState;
+
+int64_t wall_clock_ns(void) {
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void recording_segment_path(const char* path, uint64_t segment, char* buffer, size_t size) {
+	snprintf(buffer, size, "%s.%06llu.raw", path, (unsigned long long)segment);
+}
+
+static char* index_path(const char* path) {
+	const size_t size = strlen(path) + 5;
+	char* buffer = malloc(size);
+	if (buffer != NULL)
+		snprintf(buffer, size, "%s.idx", path);
+	return buffer;
+}
+
+/*
+	Close the current segment and start the next one.
+*/
+static int next_segment(Recorder* recorder) {
+	char path[1024];
+	if (recorder->segment != NULL) {
+		fclose(recorder->segment);
+		recorder->segment = NULL;
+	}
+	recording_segment_path(recorder->path, recorder->n_segments, path, sizeof(path));
+	recorder->segment = fopen(path, "wb");
+	if (recorder->segment == NULL) {
+		printf("ERR!: CANNOT OPEN %s\n", path);
+		return 0;
+	}
+	setvbuf(recorder->segment, recorder->buffer, _IOFBF, RECORDER_BUFFER);
+	printf("META: SEGMENT %s\n", path);
+	recorder->n_segments++;
+	recorder->segment_left = recorder->header.segment_samples;
+	return 1;
+}
+
+/*
+	Flush the samples of the pending stride and publish its entry.
+*/
+static int append_entry(Recorder* recorder) {
+	if (fflush(recorder->segment) != 0)
+		return 0;
+	recorder->pending.samples = recorder->samples - recorder->pending.sample;
+	recorder->pending.dataloss_events = recorder->dataloss_events;
+	if (fwrite(&recorder->pending, sizeof(RecordingEntry), 1, recorder->index) != 1)
+		return 0;
+	return fflush(recorder->index) == 0;
+}
+
+Recorder* recorder_create(const char* path, uint64_t segment_samples) {
+	Recorder* recorder = calloc(1, sizeof(Recorder));
+	if (recorder == NULL)
+		return NULL;
+	recorder->path = malloc(strlen(path) + 1);
+	recorder->buffer = malloc(RECORDER_BUFFER);
+	char* index = index_path(path);
+	if (recorder->path == NULL || recorder->buffer == NULL || index == NULL) {
+		free(index);
+		recorder_destroy(recorder);
+		return NULL;
+	}
+	strcpy(recorder->path, path);
+
+	memcpy(recorder->header.magic, RECORDING_MAGIC, sizeof(recorder->header.magic));
+	recorder->header.version = RECORDING_VERSION;
+	recorder->header.sample_rate = SAMPLE_RATE;
+	recorder->header.segment_samples = segment_samples;
+	recorder->header.stride = RECORDING_STRIDE;
+
+	recorder->index = fopen(index, "wb");
+	if (recorder->index == NULL) {
+		printf("ERR!: CANNOT OPEN %s\n", index);
+	}
+	free(index);
+	if (recorder->index == NULL
+		|| fwrite(&recorder->header, sizeof(RecordingHeader), 1, recorder->index) != 1
+		|| fflush(recorder->index) != 0) {
+		recorder_destroy(recorder);
+		return NULL;
+	}
+	return recorder;
+}
+
+/*
+	Append ndata samples; time_ns is the wall clock when the chunk arrived, i.e. just after its last sample.
+	Returns 0 if a file could not be written, the recorder then ignores all further samples.
+*/
+int recorder_write(Recorder* recorder, const uint16_t* data, int ndata, int dataloss, int64_t time_ns) {
+	const uint64_t stride = recorder->header.stride;
+	if (dataloss)
+		recorder->dataloss_events++;
+
+	int i = 0;
+	while (i < ndata && !recorder->failed) {
+		const uint64_t in_stride = recorder->samples % stride;
+		if (in_stride == 0) {
+			recorder->pending.sample = recorder->samples;
+			recorder->pending.time_ns = time_ns - (int64_t)((double)(ndata - i) * 1e9 / SAMPLE_RATE);
+		}
+		if (recorder->segment_left == 0 && !next_segment(recorder)) {
+			recorder->failed = 1;
+			break;
+		}
+
+		uint64_t n = ndata - i;
+		if (n > recorder->segment_left)
+			n = recorder->segment_left;
+		if (n > stride - in_stride)
+			n = stride - in_stride;
+		if (fwrite(data + i, sizeof(uint16_t), (size_t)n, recorder->segment) != n) {
+			recorder->failed = 1;
+			break;
+		}
+		recorder->samples += n;
+		recorder->segment_left -= n;
+		i += (int)n;
+
+		if (recorder->samples % stride == 0 && !append_entry(recorder))
+			recorder->failed = 1;
+	}
+	return !recorder->failed;
+}
+
+void recorder_destroy(Recorder* recorder) {
+	if (recorder == NULL)
+		return;
+	// publish the last, partial stride
+	if (!recorder->failed && recorder->samples % recorder->header.stride != 0)
+		append_entry(recorder);
+	if (recorder->segment != NULL)
+		fclose(recorder->segment);
+	if (recorder->index != NULL)
+		fclose(recorder->index);
+	free(recorder->buffer);
+	free(recorder->path);
+	free(recorder);
+}
+
+Recording* recording_open(const char* path) {
+	char* index = index_path(path);
+	Recording* recording = calloc(1, sizeof(Recording));
+	if (index == NULL || recording == NULL) {
+		free(index);
+		free(recording);
+		return NULL;
+	}
+	recording->index = fopen(index, "rb");
+	free(index);
+	if (recording->index == NULL
+		|| fread(&recording->header, sizeof(RecordingHeader), 1, recording->index) != 1
+		|| memcmp(recording->header.magic, RECORDING_MAGIC, sizeof(recording->header.magic)) != 0
+		|| recording->header.version != RECORDING_VERSION
+		|| recording->header.stride == 0 || recording->header.segment_samples == 0) {
+		recording_close(recording);
+		return NULL;
+	}
+	return recording;
+}
+
+void recording_close(Recording* recording) {
+	if (recording == NULL)
+		return;
+	if (recording->index != NULL)
+		fclose(recording->index);
+	free(recording);
+}
+
+/*
+	Number of complete entries, re-read on every seek as the recorder may still be appending.
+*/
+static uint64_t recording_entries(Recording* recording) {
+	if (_fseeki64(recording->index, 0, SEEK_END) != 0)
+		return recording->n_entries;
+	const int64_t size = _ftelli64(recording->index);
+	if (size >= (int64_t)sizeof(RecordingHeader))
+		recording->n_entries = (size - sizeof(RecordingHeader)) / sizeof(RecordingEntry);
+	return recording->n_entries;
+}
+
+static int read_entry(Recording* recording, uint64_t i, RecordingEntry* entry) {
+	const int64_t offset = sizeof(RecordingHeader) + i * sizeof(RecordingEntry);
+	return _fseeki64(recording->index, offset, SEEK_SET) == 0
+		&& fread(entry, sizeof(RecordingEntry), 1, recording->index) == 1;
+}
+
+/*
+	Locate a sample, fails if its stride is not indexed yet or the sample is past the end of the recording.
+*/
+int recording_seek_sample(Recording* recording, uint64_t sample, RecordingPosition* position) {
+	const RecordingHeader* header = &recording->header;
+	RecordingEntry entry;
+	const uint64_t i = sample / header->stride;
+	if (i >= recording_entries(recording) || !read_entry(recording, i, &entry)
+		|| sample >= entry.sample + entry.samples)
+		return 0;
+
+	position->sample = sample;
+	position->time_ns = entry.time_ns + (int64_t)((double)(sample - entry.sample) * 1e9 / header->sample_rate);
+	position->segment = sample / header->segment_samples;
+	position->offset = sample % header->segment_samples * sizeof(uint16_t);
+	return 1;
+}
+
+/*
+	Locate the last sample taken at or before time_ns, fails before the start or after the end of the recording.
+*/
+int recording_seek_time(Recording* recording, int64_t time_ns, RecordingPosition* position) {
+	const RecordingHeader* header = &recording->header;
+	const uint64_t n = recording_entries(recording);
+	RecordingEntry entry, next;
+	if (n == 0 || !read_entry(recording, 0, &entry) || time_ns < entry.time_ns)
+		return 0;
+
+	// the entry estimated from the nominal rate is right unless data loss or clock drift moved the strides,
+	// otherwise binary search for the last entry with entry.time_ns <= time_ns on the side of the estimate
+	const double strides = (double)(time_ns - entry.time_ns) * 1e-9 * header->sample_rate / header->stride;
+	uint64_t lo = 0, hi = n;
+	uint64_t guess = strides < (double)(n - 1) ? (uint64_t)strides : n - 1;
+	if (!read_entry(recording, guess, &entry))
+		return 0;
+	if (entry.time_ns <= time_ns) {
+		lo = guess;
+		if (guess + 1 < n) {
+			if (!read_entry(recording, guess + 1, &next))
+				return 0;
+			hi = next.time_ns > time_ns ? guess + 1 : n;
+			if (next.time_ns <= time_ns)
+				lo = guess + 1;
+		}
+	}
+	else {
+		hi = guess;
+	}
+	while (hi - lo > 1) {
+		const uint64_t mid = lo + (hi - lo) / 2;
+		if (!read_entry(recording, mid, &next))
+			return 0;
+		if (next.time_ns <= time_ns)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if (!read_entry(recording, lo, &entry))
+		return 0;
+
+	// within the stride, or its last sample if time_ns falls into a gap after it
+	uint64_t offset = (uint64_t)((double)(time_ns - entry.time_ns) * 1e-9 * header->sample_rate + 0.5);
+	if (offset >= entry.samples) {
+		if (lo + 1 == n)
+			return 0;
+		offset = entry.samples - 1;
+	}
+	return recording_seek_sample(recording, entry.sample + offset, position);
+}
+
+/*
+	Write the pool buffers in order until the transfer is done.
+*/
+static DWORD WINAPI recorder_writer(LPVOID param) {
+	RecorderState* state = (RecorderState*)param;
+	EnterCriticalSection(&state->lock);
+	for (;;) {
+		while (state->consumed == state->produced && !state->done)
+			SleepConditionVariableCS(&state->changed, &state->lock, INFINITE);
+		if (state->consumed == state->produced)
+			break;
+		RecorderBuffer* buffer = &state->buffers[state->consumed % RECORDER_POOL];
+		LeaveCriticalSection(&state->lock);
+
+		const int ok = recorder_write(state->recorder, buffer->data, buffer->n, buffer->dataloss, buffer->time_ns);
+
+		EnterCriticalSection(&state->lock);
+		if (!ok)
+			state->failed = 1;
+		state->consumed++;
+		WakeAllConditionVariable(&state->changed);
+	}
+	LeaveCriticalSection(&state->lock);
+	return 0;
+}
+
+/*
+	Number of buffers handed to the writer and not written yet.
+*/
+static int64_t recorder_in_use(RecorderState* state) {
+	EnterCriticalSection(&state->lock);
+	const int64_t in_use = state->produced - state->consumed;
+	LeaveCriticalSection(&state->lock);
+	return in_use;
+}
+
+/*
+	Hand the filled buffer to the writer.
+*/
+static void recorder_hand_over(RecorderState* state) {
+	EnterCriticalSection(&state->lock);
+	state->produced++;
+	WakeAllConditionVariable(&state->changed);
+	LeaveCriticalSection(&state->lock);
+	state->filling = 0;
+}
+
+/*
+	Copy the chunk into the buffer pool and stop after the requested length or on Ctrl+C.
+	If every buffer is waiting for the writer, the rest of the chunk is dropped and recorded as a data loss.
+*/
+int callback_recorder(uint16_t* data, int ndata, int dataloss, void* userdata)
+{
+	RecorderState* state = (RecorderState*)userdata;
+	const int64_t now = wall_clock_ns();
+
+	if (dataloss) {
+		printf("ERR!: DATA LOSS DETECTED\n");
+		state->pending_dataloss = 1;
+	}
+
+	EnterCriticalSection(&state->lock);
+	const int failed = state->failed;
+	LeaveCriticalSection(&state->lock);
+	if (failed) {
+		printf("ERR!: WRITE FAILED\n");
+		return 0;
+	}
+
+	// a data loss starts a new buffer, so the writer sees every discontinuity
+	if (state->pending_dataloss && state->filling)
+		recorder_hand_over(state);
+
+	int i = 0;
+	while (i < ndata) {
+		RecorderBuffer* buffer = &state->buffers[state->produced % RECORDER_POOL];
+		if (!state->filling) {
+			if (recorder_in_use(state) >= RECORDER_POOL) {
+				if (!state->overrun)
+					printf("ERR!: RECORDER OVERRUN\n");
+				state->overrun = 1;
+				state->overrun_samples += ndata - i;
+				state->pending_dataloss = 1;
+				break;
+			}
+			buffer->n = 0;
+			buffer->dataloss = state->pending_dataloss;
+			state->pending_dataloss = 0;
+			state->overrun = 0;
+			state->filling = 1;
+		}
+
+		int n = RECORDER_POOL_SAMPLES - buffer->n;
+		if (n > ndata - i)
+			n = ndata - i;
+		memcpy(buffer->data + buffer->n, data + i, n * sizeof(uint16_t));
+		buffer->n += n;
+		i += n;
+		// the chunk ends at now, so the buffer ends ndata - i samples earlier
+		buffer->time_ns = now - (int64_t)((double)(ndata - i) * 1e9 / SAMPLE_RATE);
+		if (buffer->n == RECORDER_POOL_SAMPLES)
+			recorder_hand_over(state);
+	}
+
+	state->samples += ndata;
+	if (state->samples >= state->report_next) {
+		printf("DATA: %llu;%lld\n", (unsigned long long)state->samples, (long long)recorder_in_use(state));
+		state->report_next += state->report_interval;
+	}
+
+	return samples_remaining(&state->samples_left, ndata, state->unlimited);
+}
+
+/*
+	Record into config->output_path until n_samples are written, or until Ctrl+C if n_samples is 0.
+*/
+ERROR_STATUS run_recorder(ri_device* device, const Config* config) {
+	RecorderState* state = calloc(1, sizeof(RecorderState));
+	if (state == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		return STATUS_FAILURE;
+	}
+	InitializeCriticalSection(&state->lock);
+	InitializeConditionVariable(&state->changed);
+	state->samples_left = config->n_samples;
+	state->unlimited = config->n_samples == 0;
+	state->report_interval = config->report_interval;
+	state->report_next = config->report_interval;
+
+	int allocated = 1;
+	for (int b = 0; b < RECORDER_POOL; ++b) {
+		state->buffers[b].data = malloc(RECORDER_POOL_SAMPLES * sizeof(uint16_t));
+		allocated = allocated && state->buffers[b].data != NULL;
+	}
+	state->recorder = allocated ? recorder_create(config->output_path, config->segment_samples) : NULL;
+	HANDLE writer = state->recorder != NULL ? CreateThread(NULL, 0, recorder_writer, state, 0, NULL) : NULL;
+	if (writer == NULL) {
+		if (!allocated)
+			printf("ERR!: OUT OF MEMORY\n");
+		else
+			printf("ERR!: CANNOT CREATE RECORDING %s\n", config->output_path);
+		recorder_destroy(state->recorder);
+		for (int b = 0; b < RECORDER_POOL; ++b)
+			free(state->buffers[b].data);
+		DeleteCriticalSection(&state->lock);
+		free(state);
+		return STATUS_FAILURE;
+	}
+
+	install_stop_handler();
+
+	printf("META: REQUEST RECORD SAMPLES %llu\n", config->n_samples);
+	printf("META: SEGMENT SAMPLES %llu\n", config->segment_samples);
+	printf("META: START_OF_STREAM\n");
+	double initial_time = (double)clock() / CLOCKS_PER_SEC;
+	int err = ri_start_continuous_transfer(device, callback_recorder, state);
+	double final_time = (double)clock() / CLOCKS_PER_SEC;
+
+	// write the partial buffer and wait for the writer
+	if (state->filling)
+		recorder_hand_over(state);
+	EnterCriticalSection(&state->lock);
+	state->done = 1;
+	WakeAllConditionVariable(&state->changed);
+	LeaveCriticalSection(&state->lock);
+	WaitForSingleObject(writer, INFINITE);
+	CloseHandle(writer);
+	printf("META: END_OF_STREAM\n");
+
+	remove_stop_handler();
+
+	const int failed = state->failed;
+	printf("META: RECORDED SAMPLES %llu\n", (unsigned long long)state->recorder->samples);
+	printf("META: SEGMENTS %llu\n", (unsigned long long)state->recorder->n_segments);
+	print_transfer_summary((int64_t)state->samples, final_time - initial_time);
+	printf("META: OVERRUN SAMPLES %llu\n", state->overrun_samples);
+	printf("META: DATA LOSS EVENTS %llu\n", (unsigned long long)state->recorder->dataloss_events);
+	recorder_destroy(state->recorder);
+	for (int b = 0; b < RECORDER_POOL; ++b)
+		free(state->buffers[b].data);
+	DeleteCriticalSection(&state->lock);
+	free(state);
+
+	return err == 0 && !failed ? STATUS_SUCCESS : STATUS_FAILURE;
+}
+
+/*
+	Print the segment and byte offset of a sample or wall clock time of the recording config->input_path.
+*/
+ERROR_STATUS run_locate(const Config* config) {
+	Recording* recording = recording_open(config->input_path);
+	if (recording == NULL) {
+		printf("ERR!: CANNOT OPEN INDEX OF %s\n", config->input_path);
+		return STATUS_FAILURE;
+	}
+
+	RecordingPosition position;
+	const int found = config->locate_by_time
+		? recording_seek_time(recording, config->locate_time_ns, &position)
+		: recording_seek_sample(recording, config->locate_sample, &position);
+	recording_close(recording);
+	if (!found) {
+		printf("ERR!: POSITION NOT IN RECORDING\n");
+		return STATUS_FAILURE;
+	}
+
+	char path[1024];
+	recording_segment_path(config->input_path, position.segment, path, sizeof(path));
+	printf("DATA: %llu;%lld.%09lld;%s;%llu\n", (unsigned long long)position.sample,
+		(long long)(position.time_ns / 1000000000), (long long)(position.time_ns % 1000000000),
+		path, (unsigned long long)position.offset);
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,77 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "ri.h"
+#include "config.h"
+#include "libdpd80.h"
+
+#define RECORDING_MAGIC "DPD80IDX"
+#define RECORDING_VERSION 1
+#define RECORDING_STRIDE (1 << 20)		// samples per index entry
+
+/*
+	A recording <path> consists of the index <path>.idx and the segments <path>.000000.raw, <path>.000001.raw, ...
+	Every segment but the last holds exactly segment_samples raw samples. The index is the header followed by one
+	entry per stride of samples; an entry is only appended once its stride is in the segment files.
+*/
+typedef struct recording_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t sample_rate;
+	uint64_t segment_samples;
+	uint64_t stride;
+} RecordingHeader;
+
+typedef struct recording_entry {
+	uint64_t sample;				// first sample of the stride
+	uint64_t samples;				// samples in the stride, less than stride only for the last entry
+	int64_t time_ns;				// wall clock of that sample, ns since 1970-01-01 UTC
+	uint64_t dataloss_events;		// cumulative up to the end of the stride
+} RecordingEntry;
+
+typedef struct recording_position {
+	uint64_t sample;
+	int64_t time_ns;
+	uint64_t segment;
+	uint64_t offset;				// bytes into the segment
+} RecordingPosition;
+
+typedef struct recorder {
+	char* path;
+	RecordingHeader header;
+	FILE* index;
+	FILE* segment;
+	char* buffer;
+	uint64_t n_segments;
+	uint64_t samples;
+	uint64_t segment_left;
+	RecordingEntry pending;			// entry of the stride being written
+	uint64_t dataloss_events;
+	int failed;
+} Recorder;
+
+typedef struct recording {
+	RecordingHeader header;
+	FILE* index;
+	uint64_t n_entries;
+} Recording;
+
+int64_t wall_clock_ns(void);
+void recording_segment_path(const char* path, uint64_t segment, char* buffer, size_t size);
+
+Recorder* recorder_create(const char* path, uint64_t segment_samples);
+int recorder_write(Recorder* recorder, const uint16_t* data, int ndata, int dataloss, int64_t time_ns);
+void recorder_destroy(Recorder* recorder);
+
+Recording* recording_open(const char* path);
+void recording_close(Recording* recording);
+int recording_seek_sample(Recording* recording, uint64_t sample, RecordingPosition* position);
+int recording_seek_time(Recording* recording, int64_t time_ns, RecordingPosition* position);
+
+ERROR_STATUS run_recorder(ri_device* device, const Config* config);
+ERROR_STATUS run_locate(const Config* config);
+int callback_recorder(uint16_t* data, int ndata, int dataloss, void* userdata);
+
+#endif
@@ -0,0 +1,315 @@
+/*
+	Link integrity self-test.
+	The ADC is switched into one of its test patterns and the stream is checked sample by sample at full rate.
+	The pattern period is learned from the start of the stream, every following sample is compared against
+	the learned period. The learned period is checked against the selected pattern, so a stuck link or an ADC that
+	ignored the pattern request fails instead of passing on its own periodic output. Mismatches are classified as a phase slip (dropped or duplicated run of samples)
+	if the stream locks onto the reference again at a different phase, otherwise as bit errors.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <emmintrin.h>
+#include "ri.h"
+#include "callbacks.h"
+#include "selftest.h"
+
+#define SELFTEST_SETTLE 80000				// samples discarded while the ADC switches pattern
+#define SELFTEST_MAX_PERIOD 1024			// longest pattern period that can be learned
+#define SELFTEST_LEARN (4 * SELFTEST_MAX_PERIOD)
+#define SELFTEST_TILE 4096					// contiguous reference samples available at every phase
+#define SELFTEST_RESYNC 64					// samples that have to match to accept a new phase
+#define SELFTEST_REPORT (80 * 1000 * 1000)	// samples between two DATA lines
+#define SELFTEST_PN9_BITS 511				// period of the PN9 bit sequence
+#define SELFTEST_BITS 14					// bits per sample
+
+typedef struct selftest_state {
+	int64_t samples_left;
+	int64_t settle_left;
+	int64_t report_next;
+	TestPattern pattern;
+	uint16_t test_value;
+
+	uint16_t learn[SELFTEST_LEARN];
+	int n_learn;
+	int period;
+	int phase;
+	int resync_holdoff;					// samples until a failed resync may be tried again
+	uint16_t ref[SELFTEST_TILE + SELFTEST_MAX_PERIOD];
+	uint16_t tail[SELFTEST_RESYNC];		// unchecked end of the last chunk, too short to resync on
+	int n_tail;
+
+	unsigned long long samples_checked;
+	unsigned long long bit_errors;
+	unsigned long long error_samples;
+	unsigned long long dropped_runs;
+	unsigned long long dropped_samples;
+	unsigned long long duplicated_runs;
+	unsigned long long duplicated_samples;
+	unsigned long long dataloss_events;
+	int failed;
+} SelftestState;
+
+static int popcount16(unsigned int x) {
+	int n = 0;
+	for (; x; x &= x - 1) {
+		++n;
+	}
+	return n;
+}
+
+/*
+	Return the index of the first sample in data that does not match ref, n if all match.
+*/
+static int compare_block(const uint16_t* data, const uint16_t* ref, int n) {
+	const __m128i mask = _mm_set1_epi16(SAMPLE_DATA_MASK);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), mask);
+		__m128i b = _mm_loadu_si128((const __m128i*)(ref + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(a, b)) != 0xffff)
+			break;
+	}
+	for (; i < n; ++i) {
+		if ((data[i] & SAMPLE_DATA_MASK) != ref[i])
+			return i;
+	}
+	return n;
+}
+
+/*
+	Find the shortest period of the learned samples and tile the reference with it.
+*/
+static int learn_period(SelftestState* state) {
+	for (int p = 1; p <= SELFTEST_MAX_PERIOD; ++p) {
+		int i = p;
+		while (i < SELFTEST_LEARN && state->learn[i] == state->learn[i - p])
+			++i;
+		if (i == SELFTEST_LEARN) {
+			for (int k = 0; k < SELFTEST_TILE + SELFTEST_MAX_PERIOD; ++k) {
+				state->ref[k] = state->learn[k % p];
+			}
+			state->period = p;
+			state->phase = SELFTEST_LEARN % p;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+	Check that the learned period is the selected test pattern.
+	PN9 is accepted with one sequence bit per sample bit (a multiple of 73 samples) or one bit per sample (511).
+*/
+static int pattern_matches(const SelftestState* state) {
+	const int p = state->period;
+	switch (state->pattern) {
+	case TEST_USER:
+		return p == 1 && state->ref[0] == (state->test_value & SAMPLE_DATA_MASK);
+	case TEST_CHECKERBOARD:
+		return p == 2 && (state->ref[0] ^ state->ref[1]) == SAMPLE_DATA_MASK;
+	default:
+		return p > 1 && ((p * SELFTEST_BITS) % SELFTEST_PN9_BITS == 0 || p % SELFTEST_PN9_BITS == 0);
+	}
+}
+
+/*
+	Classify the mismatch at data[i], at least SELFTEST_RESYNC samples must follow unless a resync is held off.
+	Returns the number of samples consumed.
+*/
+static int handle_mismatch(SelftestState* state, const uint16_t* data, int i) {
+	const int p = state->period;
+
+	if (state->resync_holdoff == 0) {
+		for (int q = 0; q < p; ++q) {
+			if (q == state->phase)
+				continue;
+			if (compare_block(data + i, state->ref + q, SELFTEST_RESYNC) == SELFTEST_RESYNC) {
+				int delta = (q - state->phase + p) % p;
+				if (delta <= p / 2) {
+					state->dropped_runs++;
+					state->dropped_samples += delta;
+				}
+				else {
+					state->duplicated_runs++;
+					state->duplicated_samples += p - delta;
+				}
+				state->phase = q;
+				return 0;
+			}
+		}
+		// no phase matches, don't search again until the burst is over
+		state->resync_holdoff = SELFTEST_RESYNC;
+	}
+
+	state->bit_errors += popcount16((data[i] & SAMPLE_DATA_MASK) ^ state->ref[state->phase]);
+	state->error_samples++;
+	state->phase = (state->phase + 1) % p;
+	if (state->resync_holdoff > 0)
+		state->resync_holdoff--;
+	return 1;
+}
+
+/*
+	Check samples against the reference. Stops early at a mismatch that needs more samples to resync,
+	returns the number of samples checked.
+*/
+static int check_samples(SelftestState* state, const uint16_t* data, int ndata) {
+	int i = 0;
+	while (i < ndata) {
+		int n = ndata - i < SELFTEST_TILE ? ndata - i : SELFTEST_TILE;
+		int m = compare_block(data + i, state->ref + state->phase, n);
+		state->phase = (state->phase + m) % state->period;
+		state->resync_holdoff = state->resync_holdoff > m ? state->resync_holdoff - m : 0;
+		i += m;
+		if (m < n) {
+			if (state->resync_holdoff == 0 && ndata - i < SELFTEST_RESYNC)
+				break;
+			i += handle_mismatch(state, data, i);
+		}
+	}
+	return i;
+}
+
+/*
+	Check every sample against the learned test pattern.
+	Prints cumulative error counters every SELFTEST_REPORT samples.
+*/
+int callback_selftest(uint16_t* data, int ndata, int dataloss, void* userdata)
+{
+	SelftestState* state = (SelftestState*)userdata;
+	int i = 0;
+
+	if (dataloss) {
+		printf("ERR!: DATA LOSS DETECTED\n");
+		state->dataloss_events++;
+	}
+
+	// skip samples while the ADC settles on the test pattern
+	if (state->settle_left > 0) {
+		int n = state->settle_left < ndata ? (int)state->settle_left : ndata;
+		state->settle_left -= n;
+		i += n;
+	}
+
+	// learn one period of the pattern
+	while (state->period == 0 && i < ndata) {
+		state->learn[state->n_learn++] = data[i++] & SAMPLE_DATA_MASK;
+		if (state->n_learn == SELFTEST_LEARN) {
+			if (!learn_period(state)) {
+				printf("ERR!: TEST PATTERN NOT PERIODIC\n");
+				state->failed = 1;
+				return 0;
+			}
+			printf("META: TEST PATTERN PERIOD %d\n", state->period);
+			if (!pattern_matches(state)) {
+				printf("ERR!: TEST PATTERN MISMATCH\n");
+				state->failed = 1;
+				return 0;
+			}
+		}
+	}
+
+	// finish the tail of the last chunk together with the start of this one
+	if (state->n_tail > 0 && i < ndata) {
+		uint16_t join[2 * SELFTEST_RESYNC];
+		const int n = ndata - i < SELFTEST_RESYNC ? ndata - i : SELFTEST_RESYNC;
+		const int total = state->n_tail + n;
+		memcpy(join, state->tail, state->n_tail * sizeof(uint16_t));
+		memcpy(join + state->n_tail, data + i, n * sizeof(uint16_t));
+		const int used = check_samples(state, join, total);
+		state->samples_checked += used;
+		if (used >= state->n_tail) {
+			i += used - state->n_tail;
+			state->n_tail = 0;
+		}
+		else {
+			// only with chunks shorter than SELFTEST_RESYNC, all of this chunk is in the join
+			state->n_tail = total - used;
+			memmove(state->tail, join + used, state->n_tail * sizeof(uint16_t));
+			i = ndata;
+		}
+	}
+
+	if (state->n_tail == 0 && i < ndata) {
+		const int used = check_samples(state, data + i, ndata - i);
+		state->samples_checked += used;
+		i += used;
+		state->n_tail = ndata - i;
+		memcpy(state->tail, data + i, state->n_tail * sizeof(uint16_t));
+	}
+
+	if ((int64_t)state->samples_checked >= state->report_next) {
+		printf("DATA: %llu;%llu;%llu;%llu;%llu;%llu\n",
+			state->samples_checked, state->bit_errors, state->error_samples,
+			state->dropped_runs, state->duplicated_runs, state->dataloss_events);
+		state->report_next += SELFTEST_REPORT;
+	}
+
+	return samples_remaining(&state->samples_left, ndata, 0);
+}
+
+/*
+	Run the link integrity self-test with the test pattern given in config.
+	The ADC is always returned to normal operation before this function returns.
+*/
+ERROR_STATUS run_selftest(ri_device* device, const Config* config) {
+	SelftestState* state = calloc(1, sizeof(SelftestState));
+	if (state == NULL) {
+		printf("ERR!: OUT OF MEMORY\n");
+		return STATUS_FAILURE;
+	}
+	state->samples_left = config->n_samples;
+	state->settle_left = SELFTEST_SETTLE;
+	state->report_next = SELFTEST_REPORT;
+	state->pattern = config->test_pattern;
+	state->test_value = config->test_value;
+
+	switch (config->test_pattern) {
+	case TEST_CHECKERBOARD:
+		printf("META: TEST PATTERN CHECKERBOARD\n");
+		ri_test_checkerboard(device);
+		break;
+	case TEST_USER:
+		printf("META: TEST PATTERN USER %u\n", config->test_value);
+		ri_test_user(device, config->test_value);
+		break;
+	default:
+		printf("META: TEST PATTERN PN9\n");
+		ri_test_pn9(device);
+		break;
+	}
+
+	install_stop_handler();
+
+	printf("META: REQUEST SELFTEST SAMPLES %llu\n", config->n_samples);
+	printf("META: START_OF_STREAM\n");
+	double initial_time = (double)clock() / CLOCKS_PER_SEC;
+	int err = ri_start_continuous_transfer(device, callback_selftest, state);
+	double final_time = (double)clock() / CLOCKS_PER_SEC;
+	printf("META: END_OF_STREAM\n");
+
+	ri_test_normal(device);
+	remove_stop_handler();
+
+	print_transfer_summary((int64_t)config->n_samples - state->samples_left, final_time - initial_time);
+	printf("META: SAMPLES CHECKED %llu\n", state->samples_checked);
+	printf("META: BIT ERRORS %llu\n", state->bit_errors);
+	printf("META: ERROR SAMPLES %llu\n", state->error_samples);
+	printf("META: BIT ERROR RATE %g\n",
+		state->samples_checked ? state->bit_errors / (14. * state->samples_checked) : 0.);
+	printf("META: DROPPED RUNS %llu (%llu SAMPLES)\n", state->dropped_runs, state->dropped_samples);
+	printf("META: DUPLICATED RUNS %llu (%llu SAMPLES)\n", state->duplicated_runs, state->duplicated_samples);
+	printf("META: DATA LOSS EVENTS %llu\n", state->dataloss_events);
+
+	int passed = err == 0 && !state->failed && state->period != 0
+		&& state->error_samples == 0 && state->dropped_runs == 0
+		&& state->duplicated_runs == 0 && state->dataloss_events == 0;
+	printf("META: SELFTEST %s\n", passed ? "PASSED" : "FAILED");
+
+	free(state);
+	return passed ? STATUS_SUCCESS : STATUS_FAILURE;
+}
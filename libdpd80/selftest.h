@@ -0,0 +1,11 @@
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+#include "ri.h"
+#include "config.h"
+#include "libdpd80.h"
+
+ERROR_STATUS run_selftest(ri_device* device, const Config* config);
+int callback_selftest(uint16_t* data, int ndata, int dataloss, void* userdata);
+
+#endif